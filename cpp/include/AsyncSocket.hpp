@@ -5,6 +5,7 @@
 #include <sys/socket.h>
 #include <netinet/in.h>
 #include <arpa/inet.h>
+#include <netinet/tcp.h>
 #include <unistd.h>
 #elif __APPLE__
 #include <sys/types.h>
@@ -18,6 +19,10 @@
 #include <glog/logging.h>
 #include <shared_mutex>
 
+#define HIGH_PRIORITY_SEND_BUFFER_SIZE  16384
+#define HIGH_PRIORITY_DSCP              46  // expedited forwarding
+#define HIGH_PRIORITY_SOCKET_PRIORITY   6
+
 namespace core {
     using namespace std;
     class Socket {
@@ -25,11 +30,14 @@ namespace core {
         static const int                maxevents = 128;
         int                             set_nonblock(const int& fd);
         int                             create_socket();
+        int                             set_high_priority(const int& fd);
+        int                             set_zerocopy(const int& fd);
     #ifdef __linux__
         int                             epoll_fd;
         struct epoll_event              events[maxevents];
         int                             add_epoll_event(const int& fd, const int& events); 
         int                             delete_epoll_event(const int& fd); 
+        int                             modify_epoll_event(const int& fd, const int& events); 
         int                             init_epoll(); 
     #elif __APPLE__
         int                             kq_fd;
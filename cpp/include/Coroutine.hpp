@@ -0,0 +1,112 @@
+#ifndef COROUTINE_HPP
+#define COROUTINE_HPP
+#include <coroutine>
+#include <exception>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <condition_variable>
+#include <chrono>
+#include <vector>
+#include <glog/logging.h>
+
+namespace core {
+using namespace std;
+/*
+Cancel state of one service call, shared by copies. cancel() runs the registered callbacks once,
+a callback registered after that runs at once. Threaded handlers wait on it instead of polling isPrompted.
+on_cancel returns the id to remove the callback with once it may no longer run, 0 if it already ran.
+*/
+class CancellationToken final {
+    public:
+    CancellationToken();
+    bool                                                cancelled() const;
+    void                                                cancel();
+    uint64_t                                            on_cancel(function<void()> cb);
+    void                                                remove_on_cancel(const uint64_t& id);
+    bool                                                wait_for(const chrono::nanoseconds& timeout) const; // true if cancelled
+    private:
+    struct state {
+        mutable mutex                                   mtx;
+        mutable condition_variable                      cv;
+        bool                                            cancelled = false;
+        uint64_t                                        next_id = 1;
+        vector<pair<uint64_t, function<void()>>>        callbacks;
+    };
+    shared_ptr<state>                                   state_;
+};
+
+/*
+Return type of coroutine service handlers. The task is started by the server and frees itself at its end,
+when it calls the done callback that writes the reply.
+*/
+class ServiceTask final {
+    public:
+    struct promise_type {
+        function<void()>                                on_done;
+        ServiceTask                                     get_return_object() {return ServiceTask(coroutine_handle<promise_type>::from_promise(*this));}
+        suspend_always                                  initial_suspend() noexcept {return {};}
+        auto                                            final_suspend() noexcept {
+            struct final_awaiter {
+                bool                                    await_ready() noexcept {return false;}
+                void                                    await_suspend(coroutine_handle<promise_type> handle) noexcept {
+                    function<void()> done = move(handle.promise().on_done);
+                    handle.destroy();
+                    if (done) done();
+                }
+                void                                    await_resume() noexcept {}
+            };
+            return final_awaiter{};
+        }
+        void                                            return_void() {}
+        void                                            unhandled_exception() {LOG(ERROR) << "service coroutine threw an exception, the call is aborted";}
+    };
+    ServiceTask(ServiceTask&& other) noexcept : handle_(other.handle_) {other.handle_ = nullptr;}
+    ServiceTask(const ServiceTask&)                     = delete;
+    ~ServiceTask()                                      {if (handle_) handle_.destroy();}
+    void                                                start(function<void()> on_done);
+    private:
+    explicit ServiceTask(coroutine_handle<promise_type> handle) : handle_(handle) {}
+    coroutine_handle<promise_type>                      handle_;
+};
+
+/*
+co_await of a service request. The starter hands the request to a server and calls the handler once,
+with the reply or with the error. The coroutine resumes on the thread calling the handler: a worker of the
+client's pool, the reader thread of the server without a pool, or the awaiting thread if nothing was sent.
+*/
+template<typename Reply>
+class ReplyAwaiter final {
+    public:
+    using ReplyHandler = function<void(Reply, exception_ptr)>;
+    using Starter = function<void(ReplyHandler)>;
+    ReplyAwaiter(Starter start) : start_(move(start)) {}
+    bool                                                await_ready() const noexcept {return false;}
+    void                                                await_suspend(coroutine_handle<> handle);
+    Reply                                               await_resume();
+    private:
+    Starter                                             start_;
+    Reply                                               reply_;
+    exception_ptr                                       error_;
+};
+
+template<typename Reply>
+void ReplyAwaiter<Reply>::await_suspend(coroutine_handle<> handle) {
+    // the coroutine may be resumed, even finished, before start_ returns, so nothing of this is touched after it
+    ReplyAwaiter* awaiter = this;
+    Starter start = move(start_);
+    start([awaiter, handle](Reply reply, exception_ptr error) {
+        awaiter->reply_ = move(reply);
+        awaiter->error_ = error;
+        handle.resume();
+    });
+}
+
+template<typename Reply>
+Reply ReplyAwaiter<Reply>::await_resume() {
+    if (error_) rethrow_exception(error_);
+    return move(reply_);
+}
+}
+
+#endif
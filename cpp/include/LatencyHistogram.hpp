@@ -0,0 +1,48 @@
+#ifndef LATENCY_HISTOGRAM_HPP
+#define LATENCY_HISTOGRAM_HPP
+#include <atomic>
+#include <array>
+#include <vector>
+#include <chrono>
+#include <cstdint>
+#include <algorithm>
+
+namespace core {
+using namespace std;
+/*
+Lock free histogram of durations in microseconds, four buckets per power of two so a percentile is
+within 25% of the true value. Durations over 2^32 us go to the last bucket.
+*/
+class LatencyHistogram final {
+    public:
+    static const int                                    BUCKETS = 124;
+    struct Snapshot {
+        uint64_t                                        count = 0;
+        chrono::microseconds                            sum {0};
+        vector<uint64_t>                                buckets;
+        chrono::microseconds                            mean() const;
+        chrono::microseconds                            percentile(const double& p) const;  // upper bound of the bucket, p in [0, 100]
+    };
+    LatencyHistogram();
+    void                                                record(const chrono::nanoseconds& time);
+    Snapshot                                            snapshot() const;
+    static int                                          bucket(const uint64_t& us);
+    static chrono::microseconds                         bucket_bound(const int& bucket);
+    private:
+    array<atomic<uint64_t>, BUCKETS>                    buckets_;
+    atomic<uint64_t>                                    sum_ {0};
+};
+
+/*
+Latency of the calls of one service. queue is from receipt to start on the server, execute is the handler,
+transport is what a client waited on top of those two, total is the whole round trip seen by a client.
+*/
+struct ServiceLatency {
+    LatencyHistogram::Snapshot                          queue;
+    LatencyHistogram::Snapshot                          execute;
+    LatencyHistogram::Snapshot                          transport;
+    LatencyHistogram::Snapshot                          total;
+};
+}
+
+#endif
@@ -0,0 +1,94 @@
+#ifndef LOCAL_SERVICE_HPP
+#define LOCAL_SERVICE_HPP
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <thread>
+#include <mutex>
+#include <atomic>
+#include <memory>
+#include <functional>
+#include <map>
+#include <unordered_map>
+#include "service.pb.h"
+#include "serialization.hpp"
+#include "AsyncSocket.hpp"
+
+namespace core {
+using namespace std;
+/*
+Service calls between nodes of one host skip grpc and Any packing: after a handshake that checks the types once,
+each request or reply is [request id: uint64][code: int32][times: 2 x int64] followed by the length prefixed message
+of serialize(). code is the ServiceRPCSetting of a request or the ServiceRPCStatus of a reply. The times of a request
+are its timeout and 0, of a reply the queue and execute time of the call, all in microseconds.
+*/
+const uint32_t LOCAL_CALL_HEADER_SIZE   = 28;
+const size_t   LOCAL_OUTBOX_LIMIT       = 64 << 20; // unsent replies of a client that stopped reading, then it is dropped
+
+// unix socket name of a service, derived from its grpc address so only a server on this host can match
+string local_service_path(const string& service, const string& srv_addr);
+string local_call_header(const uint64_t& request_id, const int32_t& code, const int64_t& time0 = 0, const int64_t& time1 = 0);
+// size of the complete frame at offset, 0 if it has not fully arrived
+size_t read_local_call(const string& buf, const size_t offset, uint64_t& request_id, int32_t& code, int64_t& time0, int64_t& time1);
+
+class LocalServiceServer final : public Socket {
+    public:
+    using CallHandler = function<void(const uint64_t& connection, const uint64_t& request_id, const int32_t& code, const int64_t& timeout_us, const char* msg, const int size)>;
+    using CloseHandler = function<void(const uint64_t& connection)>;
+    LocalServiceServer(const string& path, const service_rpc::ServiceLocalHandshake& types, CallHandler on_call, CloseHandler on_close);
+    ~LocalServiceServer();
+    bool                                                valid();
+    bool                                                write(const uint64_t& connection, const uint64_t& request_id, const int32_t& code, const string& msg,
+                                                            const int64_t& queue_us = 0, const int64_t& execute_us = 0);
+    // a feedback that finds the socket full replaces the unsent one of the same request
+    bool                                                write_feedback(const uint64_t& connection, const uint64_t& request_id, const string& msg);
+    private:
+    struct connection_info {
+        ~connection_info()                              {close(fd);}
+        int                                             fd;
+        uint64_t                                        id;
+        bool                                            accepted = false;
+        string                                          buffer;
+        mutex                                           write_mtx;
+        string                                          outbox;             // guarded by write_mtx, sent when the socket is writable
+        bool                                            want_write = false;
+        map<uint64_t, string>                           feedback;           // guarded by write_mtx, newest unsent feedback frame by request id
+    };
+    const string                                        path_;
+    service_rpc::ServiceLocalHandshake                  types_;
+    CallHandler                                         on_call_;
+    CloseHandler                                        on_close_;
+    int                                                 listen_fd = -1;
+    uint64_t                                            next_connection = 1;
+    unordered_map<int, shared_ptr<connection_info>>     fd_connections;
+    unordered_map<uint64_t, shared_ptr<connection_info>> connections;
+    shared_mutex                                        mtx;
+    atomic<bool>                                        running;
+    thread                                              io_thread;
+
+    void                                                io_loop();
+    void                                                accept_connection();
+    void                                                handle_connection(const int& fd);
+    bool                                                handshake(connection_info& connection);
+    bool                                                send_queued(connection_info& connection, const string& data);
+    void                                                flush_connection(const int& fd);
+    void                                                watch_writable(connection_info& connection, const bool& enable);
+    void                                                close_connection(const int& fd);
+};
+
+class LocalServiceClient final {
+    public:
+    LocalServiceClient() = default;
+    ~LocalServiceClient();
+    bool                                                connect(const string& path, const service_rpc::ServiceLocalHandshake& types);
+    bool                                                write(const uint64_t& request_id, const int32_t& code, const string& msg, const int64_t& timeout_us = 0);
+    bool                                                read(uint64_t& request_id, int32_t& code, string& msg, int64_t& queue_us, int64_t& execute_us); // blocks, one reader only
+    void                                                disconnect();   // wakes a blocked read
+    private:
+    int                                                 fd = -1;
+    string                                              buffer;
+    mutex                                               write_mtx;
+    bool                                                fill(const size_t size);
+};
+}
+
+#endif
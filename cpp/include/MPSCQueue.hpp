@@ -0,0 +1,57 @@
+#ifndef MPSC_QUEUE_HPP
+#define MPSC_QUEUE_HPP
+#include <atomic>
+#include <utility>
+
+namespace core {
+    using namespace std;
+    /*
+    Unbounded multi-producer single-consumer queue (Vyukov).
+    push is wait-free apart from the allocation of its node and may be called from any thread,
+    pop must only be called by one consumer thread. Nodes are not pooled, each push and pop goes through the allocator.
+    */
+    template<typename T>
+    class MPSCQueue {
+        public:
+        MPSCQueue() {
+            node* stub = new node();
+            head.store(stub, memory_order_relaxed);
+            tail = stub;
+        }
+        ~MPSCQueue() {
+            T value;
+            while (pop(value)) {}
+            delete tail;
+        }
+        MPSCQueue(const MPSCQueue&)             = delete;
+        MPSCQueue& operator=(const MPSCQueue&)  = delete;
+
+        void push(T value) {
+            node* n = new node();
+            n->value = move(value);
+            node* prev = head.exchange(n, memory_order_acq_rel);
+            prev->next.store(n, memory_order_release);
+        }
+        bool pop(T& value) {
+            node* next = tail->next.load(memory_order_acquire);
+            if (!next) return false;
+            value = move(next->value);
+            delete tail;
+            tail = next;
+            return true;
+        }
+        bool empty() const {
+            return !tail->next.load(memory_order_acquire);
+        }
+
+        private:
+        struct node {
+            atomic<node*>                   next {nullptr};
+            T                               value;
+        };
+        atomic<node*>                       head;
+        node*                               tail;
+    };
+}
+
+#endif
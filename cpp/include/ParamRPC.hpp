@@ -3,7 +3,10 @@
 #include "param.grpc.pb.h"
 #include <thread>
 #include <queue>
+#include <set>
+#include <deque>
 #include "common.hpp"
+#include "WorkerPool.hpp"
 #include <grpcpp/ext/proto_server_reflection_plugin.h>
 #include <grpcpp/grpcpp.h>
 #include <grpcpp/health_check_service_interface.h>
@@ -15,44 +18,133 @@ using namespace std;
 using namespace grpc;
 class ParameterBase {
     public:
+    virtual ~ParameterBase()                = default;
     virtual void                            setRemoteValue(const google::protobuf::Any& val) = 0;
     virtual google::protobuf::Any           getRemoteValue() = 0;
 };
 
+/*
+Left-right pair of values: readers count themselves in on one side and read the instance the writers
+are not touching, so a read is wait free and never blocks on a writer. A writer updates the idle instance,
+switches readers over, waits for the readers still on the old side, then updates that one too.
+*/
+template<class T>
+class LeftRight {
+    public:
+    LeftRight(const T& val)                 : instances{val, val} {}
+    template<typename F>
+    void                                    read(F&& f) const;
+    void                                    write(const T& val);
+    private:
+    T                                       instances[2];
+    atomic<int>                             left_right {0};     // instance readers use
+    atomic<int>                             version_index {0};  // side new readers count on
+    mutable atomic<int64_t>                 readers[2] = {0, 0};
+    mutex                                   writer_mtx;
+};
+
+template<class T>
+template<typename F>
+void LeftRight<T>::read(F&& f) const {
+    const int version = version_index.load();
+    readers[version].fetch_add(1);
+    f(static_cast<const T&>(instances[left_right.load()]));
+    readers[version].fetch_sub(1);
+}
+template<class T>
+void LeftRight<T>::write(const T& val) {
+    unique_lock<mutex> lock(writer_mtx);
+    const int side = left_right.load();
+    instances[1 - side] = val;
+    left_right.store(1 - side);
+    const int version = version_index.load();
+    while (readers[1 - version].load() != 0) this_thread::yield();
+    version_index.store(1 - version);
+    while (readers[version].load() != 0) this_thread::yield();
+    instances[side] = val;
+}
+
 template<class T>
 class Parameter : public ParameterBase {
     public:
     Parameter(T val_) : val(val_)           {}
     void                                    set(T val_) ;
     T                                       get() ;
+    template<typename F>
+    void                                    read(F&& f) const {val.read(forward<F>(f));}
     virtual void                            setRemoteValue(const google::protobuf::Any& val_) override;
     virtual google::protobuf::Any           getRemoteValue() override ;
 
     private:
-    T                                       val;
-    shared_mutex                            mtx;
+    LeftRight<T>                            val;
 };
 
 template<class T>
 void Parameter<T>::set(T val_) {
-    unique_lock<shared_mutex> lock(mtx);
-    val = val_;
+    val.write(val_);
 }
 template<class T>
 T Parameter<T>::get() {
-    shared_lock<shared_mutex> lock(mtx);
-    return val;
+    T val_;
+    val.read([&](const T& current) {val_ = current;});
+    return val_;
 }
 template<class T>
 void Parameter<T>::setRemoteValue(const google::protobuf::Any& val_) {
-    unique_lock<shared_mutex> lock(mtx);
-    val_.UnpackTo(&val);
+    T unpacked;
+    val_.UnpackTo(&unpacked);
+    val.write(unpacked);
 }
 template<class T>
 google::protobuf::Any Parameter<T>::getRemoteValue() {
-    shared_lock<shared_mutex> lock(mtx);
     google::protobuf::Any val_;
-    return val_.PackFrom(val), val_;
+    val.read([&](const T& current) {val_.PackFrom(current);});
+    return val_;
+}
+
+/*
+Value of a parameter loaded from a snapshot and not declared yet, served to remote nodes as it is.
+The declare replaces it with a typed parameter.
+*/
+class SnapshotParameter : public ParameterBase {
+    public:
+    SnapshotParameter(const google::protobuf::Any& val_) : val(val_) {}
+    virtual void                            setRemoteValue(const google::protobuf::Any& val_) override {val = val_;}
+    virtual google::protobuf::Any           getRemoteValue() override {return val;}
+    private:
+    google::protobuf::Any                   val;
+};
+
+/*
+Handle of a declared parameter for hot loops, a read takes no lock and is never held up by set or setRemoteParam.
+Parameters live as long as their node, so does the handle. A handle from a failed declare reads a default T.
+*/
+template<class T>
+class ParamHandle {
+    public:
+    ParamHandle()                           = default;
+    explicit ParamHandle(Parameter<T>* param) : param_(param) {}
+    bool                                    valid() const {return param_ != nullptr;}
+    T                                       get() const;
+    template<typename F>
+    void                                    read(F&& f) const;  // f(const T&), no copy
+    private:
+    Parameter<T>*                           param_ = nullptr;
+};
+
+template<class T>
+T ParamHandle<T>::get() const {
+    if (param_) return param_->get();
+    LOG_FIRST_N(ERROR, 1) << "get of an invalid handle of a " << T::descriptor()->full_name() << " parameter";
+    return T();
+}
+
+template<class T>
+template<typename F>
+void ParamHandle<T>::read(F&& f) const {
+    if (param_) return param_->read(forward<F>(f));
+    LOG_FIRST_N(ERROR, 1) << "read of an invalid handle of a " << T::descriptor()->full_name() << " parameter";
+    f(T());
 }
 
 class ParamRPCServerImpl final :public ParamRPC::Service {
@@ -62,125 +154,286 @@ class ParamRPCServerImpl final :public ParamRPC::Service {
                                             const getParamRPCRequest*request, ServerWriter<getParamRPCReply>* writer);
     Status                                  setRemoteParam(ServerContext* context, 
                                             const setParamRPCRequest*request, setParamRPCReply* reply);
+    Status                                  watchRemoteParams(ServerContext* context,
+                                            ServerReaderWriter<ParamWatchUpdate, ParamWatchRequest>* stream);
+    Status                                  batchRemoteParams(ServerContext* context,
+                                            const ParamBatchRequest* request, ParamBatchReply* reply);
     template<class T>
-    void                                    declare(const string& name, T val, bool is_const = false);
+    ParamHandle<T>                          declare(const string& name, T val, bool is_const = false);
     template<class T>                       
-    void                                    set(const string& name, T val);
+    bool                                    set(const string& name, T val);
     template<class T>                       
     bool                                    get(const string& name, T& val, void(*cb)(const T) = nullptr);
+    bool                                    save(const string& path);
+    bool                                    load(const string& path);
+    void                                    publishEvents(function<void(const ParamEvent&)> publish);   // called on the dispatcher
 
     private:
-    unordered_map<string, ParameterBase*>   params; // param_name, val
-    unordered_map<string, atomic<int>>      params_version;
-    shared_mutex                            params_mtx;
-    unordered_set<string>                   is_const_params;
-    shared_mutex                            is_const_params_mtx;
+    /*
+    A dynamic parameter callback, run on the dispatcher when its parameter is declared or changed.
+    Changes while it is pending are merged, it reads the value when it runs.
+    */
+    struct param_watcher {
+        function<void()>                    notify;
+        atomic<bool>                        pending {false};
+    };
+    /*
+    A parameter with the full name of its message type, typed accesses are checked against it. packed is the
+    value of packed_version serialized, remote reads copy it and it is packed again only after a change.
+    */
+    struct param_entry {
+        string                              name;
+        string                              type;
+        unique_ptr<ParameterBase>           value;
+        bool                                declared = false;   // a Parameter<T>, else a SnapshotParameter
+        bool                                is_const = false;
+        atomic<int>                         version {1};
+        google::protobuf::Any               packed;
+        int                                 packed_version = 0;
+        mutex                               packed_mtx;
+    };
+    deque<param_entry>                      entries;    // never move, handles point into them
+    unordered_map<string, param_entry*>     params;     // param_name, its entry
+    shared_mutex                            params_mtx; // guards entries and params, and the entries but packed
+    unordered_map<string, vector<shared_ptr<param_watcher>>> watchers;  // param_name, its callbacks
+    function<void(const ParamEvent&)>       event_publish;
+    unordered_map<string, shared_ptr<param_watcher>> event_watchers;   // param_name, publishes its events
+    mutex                                   watchers_mtx;   // guards watchers and the events
+    // parameters of one watch stream changed since its last update
+    struct watch_session {
+        mutex                               mtx;
+        condition_variable                  cv;
+        std::set<string>                    dirty;
+        bool                                closed = false;
+        unordered_map<string, shared_ptr<param_watcher>> watching;  // only used by the reading thread
+    };
 
     mutex                                   mtx;
     condition_variable                      cv;
 
     bool                                    find_param(const string& name);
-    bool                                    is_const(const string& name);
+    int                                     version_of(const string& name);    // 0 if not declared
+    // under params_mtx
+    param_entry*                            find_entry(const string& name);
+    const google::protobuf::Any&            packed(param_entry& entry);
+    ParameterStatus                         check_set(param_entry* entry, const google::protobuf::Any& payload, const int64_t& expected_version = 0);
+    static string                           type_of(const google::protobuf::Any& payload);
+    void                                    add_watcher(const string& name, shared_ptr<param_watcher> watcher);
+    void                                    remove_watcher(const string& name, const shared_ptr<param_watcher>& watcher);
+    void                                    notify_watchers(const string& name);
+    void                                    notify(const shared_ptr<param_watcher>& watcher);
+    void                                    publish_event(const string& name);
+    WorkerPool                              dispatcher {1}; // last, queued callbacks finish before the parameters go
 };
 
 template<class T>
-void ParamRPCServerImpl::declare(const string& name, T val, bool is_const) {
-    if (find_param(name)) {
+ParamHandle<T> ParamRPCServerImpl::declare(const string& name, T val, bool is_const) {
+    const string type = T::descriptor()->full_name();
+    unique_lock<shared_mutex> lock(params_mtx);
+    param_entry* entry = find_entry(name);
+    if (entry && entry->declared) {
         LOG(ERROR) << "parameter: " << name << " has declared";
-        return;
+        if (entry->type != type) {
+            LOG(ERROR) << "parameter: " << name << " is a " << entry->type << ", not a " << type;
+            return ParamHandle<T>();
+        }
+        return ParamHandle<T>(static_cast<Parameter<T>*>(entry->value.get()));
     }
-    unique_lock<shared_mutex> lock(params_mtx);
-    params[name] = static_cast<ParameterBase*> (new Parameter<T>(val));
-    params_version[name] = 1;
-    if (is_const) {
-        unique_lock<shared_mutex> lock(is_const_params_mtx);
-        is_const_params.insert(name);
+    if (!entry) {
+        entry = &entries.emplace_back();
+        entry->name = name;
+        params[name] = entry;
+    } else if (entry->type == type) {
+        // a value loaded from a snapshot wins over the default and keeps its version
+        entry->value->getRemoteValue().UnpackTo(&val);
+    } else {
+        LOG(WARNING) << "parameter: " << name << " in the snapshot is a " << entry->type << ", the default is used";
+        entry->version++;
     }
+    Parameter<T>* param = new Parameter<T>(val);
+    entry->value.reset(param);
+    entry->type = type;
+    entry->declared = true;
+    entry->is_const = is_const;
+    lock.unlock();
     cv.notify_all();
+    notify_watchers(name);
+    return ParamHandle<T>(param);
 }
 
 template<class T>                       
-void ParamRPCServerImpl::set(const string& name, T val) {
-    if (!find_param(name)) {
-        LOG(WARNING) << "parameter: " << name << " was not declared";
-        return;
-    }
-    if (is_const(name)) {
-        LOG(WARNING) << "parameter: " << name << " is a constant";
-        return;
+bool ParamRPCServerImpl::set(const string& name, T val) {
+    {
+        unique_lock<shared_mutex> lock(params_mtx);
+        param_entry* entry = find_entry(name);
+        if (!entry) {
+            LOG(WARNING) << "parameter: " << name << " was not declared";
+            return false;
+        }
+        if (entry->is_const) {
+            LOG(WARNING) << "parameter: " << name << " is a constant";
+            return false;
+        }
+        if (entry->type != T::descriptor()->full_name()) {
+            LOG(WARNING) << "parameter: " << name << " is a " << entry->type << ", not a " << T::descriptor()->full_name();
+            return false;
+        }
+        if (entry->declared) static_cast<Parameter<T>*>(entry->value.get())->set(val);
+        else {
+            google::protobuf::Any payload;
+            payload.PackFrom(val);
+            entry->value->setRemoteValue(payload);
+        }
+        entry->version++;
     }
-    unique_lock<shared_mutex> lock(params_mtx);
-    static_cast<Parameter<T>*>(params[name])->set(val);
-    params_version[name] ++;
     cv.notify_all();
+    notify_watchers(name);
+    return true;
 }
 
 template<class T>                       
 bool ParamRPCServerImpl::get(const string& name, T& val, void(*cb)(const T)) {
     if (!cb) {
-        if (find_param(name)) {
-            shared_lock<shared_mutex> lock(params_mtx);
-            val = static_cast<Parameter<T>*>(params[name])->get();
-            return true;
+        shared_lock<shared_mutex> lock(params_mtx);
+        param_entry* entry = find_entry(name);
+        if (!entry) return false;
+        if (entry->type != T::descriptor()->full_name()) {
+            LOG(WARNING) << "parameter: " << name << " is a " << entry->type << ", not a " << T::descriptor()->full_name();
+            return false;
         }
-        return false;
+        if (!entry->declared) return packed(*entry).UnpackTo(&val);    // loaded, not declared yet
+        val = static_cast<Parameter<T>*>(entry->value.get())->get();
+        return true;
     }
-    thread( [this, cb, name] () {
-        int version = 0;
-        while (core::ok()) {
-            T param;
-            if (get(name, param)) {
-                version = params_version[name].load();
-                cb(param);
-            }
-            unique_lock<mutex> lock(mtx);
-            cv.wait(lock, [&]() {
-                return (find_param(name) && version != params_version[name].load()) || !core::ok();
-            });
-        }
-    }).detach();
+    auto watcher = make_shared<param_watcher>();
+    watcher->notify = [this, cb, name]() {
+        T param;
+        if (get(name, param)) cb(param);
+    };
+    add_watcher(name, watcher);
+    // a parameter not declared yet is reported by its declare
+    if (find_param(name)) notify(watcher);
     return true;
 }
 
+/*
+Many reads and sets of the parameters of one node in a single round trip. get takes a name or a prefix such as
+"controller/*". A set with a version only applies if the parameter is still at that version, with setAtomic
+the sets are applied all together or not at all, and no other set comes in between.
+*/
+class ParamBatch {
+    public:
+    ParamBatch&                             get(const string& name);
+    template<class T>
+    ParamBatch&                             set(const string& name, const T& val, const int64_t& expected_version = 0);
+    ParamBatch&                             setAtomic(const bool atomic = true);
+    const ParamBatchRequest&                request() const {return request_;}
+    private:
+    ParamBatchRequest                       request_;
+};
+
+template<class T>
+ParamBatch& ParamBatch::set(const string& name, const T& val, const int64_t& expected_version) {
+    ParamEntry* entry = request_.add_set();
+    entry->set_name(name);
+    entry->mutable_payload()->PackFrom(val);
+    entry->set_version(expected_version);
+    return *this;
+}
+
+class ParamBatchResult {
+    public:
+    ParamBatchResult()                      = default;
+    ParamBatchResult(ParamBatchReply reply);
+    ParameterStatus                         status() const {return reply_.status();}
+    vector<string>                          names() const;  // every parameter read, prefixes expanded
+    template<class T>
+    ParameterStatus                         get(const string& name, T& val, int64_t* version = nullptr) const;
+    ParameterStatus                         setStatus(const string& name, int64_t* version = nullptr) const;
+    private:
+    ParamBatchReply                         reply_;
+    unordered_map<string, int>              got_index;
+    unordered_map<string, int>              set_index;
+};
+
+template<class T>
+ParameterStatus ParamBatchResult::get(const string& name, T& val, int64_t* version) const {
+    auto it = got_index.find(name);
+    if (it == got_index.end()) return ParameterStatus::TMEP_NOT_AVALIABLE;
+    const ParamEntry& entry = reply_.got(it->second);
+    if (entry.status() != ParameterStatus::NORMAL) return entry.status();
+    if (!entry.payload().UnpackTo(&val)) {
+        LOG(WARNING) << "parameter: " << name << " is not a " << T::descriptor()->full_name();
+        return ParameterStatus::TYPE_MISMATCH;
+    }
+    if (version) *version = entry.version();
+    return ParameterStatus::NORMAL;
+}
+
+/*
+Latest value of a watched remote parameter, reads are served from it without a call. Each update gets a new
+version, get with a version copies nothing, and returns false, while the value is still at that version.
+*/
 class ParamSlot {
     public:
     ParamSlot()                             {data.set_status(ParameterStatus::TMEP_NOT_AVALIABLE);}
-    virtual void                            get(getParamRPCReply& reply);
+    virtual ~ParamSlot()                    = default;
+    bool                                    get(getParamRPCReply& reply, int64_t* version = nullptr);
     virtual void                            set(const getParamRPCReply& reply);
+    bool                                    wait_until(const chrono::steady_clock::time_point& deadline);  // true once it has a value
+    private:
     getParamRPCReply                        data;
+    int64_t                                 version_ = 0;
+    mutex                                   mtx;
+    condition_variable                      cv;
 };
 
 class DynamicParamSlot : public ParamSlot {
     public:
     using CallBackFunc = function<void(const getParamRPCReply)>;
-    DynamicParamSlot(CallBackFunc cb_) : cb(cb_), ParamSlot() {}
+    DynamicParamSlot(CallBackFunc cb_, shared_ptr<WorkerPool> dispatcher_) : cb(cb_), dispatcher(dispatcher_), ParamSlot() {}
     void                                    set(const getParamRPCReply& reply) override;
-    void                                    get(getParamRPCReply& reply) override;
     private:
     CallBackFunc                            cb;
+    shared_ptr<WorkerPool>                  dispatcher;     // runs the callbacks in order of the updates
 };
 
+/*
+All the parameters watched on one peer share a single watch stream, they are added to it and removed from it
+as they come and go, and its reader thread fills their slots.
+*/
 class ParamRPCClient {
     public:
-    ParamRPCClient(shared_ptr<Channel> channel);
+    ParamRPCClient(shared_ptr<Channel> channel, shared_ptr<WorkerPool> dispatcher_);
     ~ParamRPCClient();
     setParamRPCReply                        setRemoteParam(const setParamRPCRequest& request);
+    ParamBatchReply                         batchRemoteParams(const ParamBatchRequest& request);
     void                                    getRemoteParam(const getParamRPCRequest& request, getParamRPCReply& reply, function<void(const getParamRPCReply)> cb = nullptr);
+    ParameterStatus                         getRemoteParam(const string& name, getParamRPCReply& reply,
+                                            const chrono::steady_clock::time_point& deadline, int64_t* version = nullptr);
+    void                                    unwatchRemoteParam(const string& name);
     
     private:
-    using ReceivedSet = unordered_map<string, ParamSlot*>;
+    using ReceivedSet = unordered_map<string, shared_ptr<ParamSlot>>;
+    using WatchStream = unique_ptr<ClientReaderWriter<ParamWatchRequest, ParamWatchUpdate>>;
     unique_ptr<ParamRPC::Stub>              stub_;
     bool                                    find_param(const string& name);
-    queue<thread>                           write_thread;
-    shared_mutex                            write_thread_mtx;
+    shared_ptr<ParamSlot>                   slot(const string& name);  // watched from the first call on
+    void                                    write_watch(const ParamWatchRequest& request);
+    void                                    read_updates();
+    unique_ptr<ClientContext>               watch_context;
+    WatchStream                             watch_stream;
+    mutex                                   watch_mtx;      // guards the stream setup and its writes
+    thread                                  watch_thread;
     ReceivedSet                             get_replies;
     shared_mutex                            get_replies_mtx;
+    shared_ptr<WorkerPool>                  dispatcher;
 };
 
 class ParamRPCClientClub final {
     public:
     using CallBackFunc = function<void(const getParamRPCReply)>;
-    using ClientClub = unordered_map<string, unique_ptr<ParamRPCClient>>;
+    using ClientClub = unordered_map<string, shared_ptr<ParamRPCClient>>;
     struct getRequestPack {
         public:
         getRequestPack(const getParamRPCRequest req_, CallBackFunc cb_ = nullptr) : req(req_), cb(cb_) {}
@@ -198,12 +451,20 @@ class ParamRPCClientClub final {
     template<class T>
     ParameterStatus                         getRemoteRequest(const string& name, T& reply, const string& namespace_);
     template<class T>
+    ParameterStatus                         getRemoteRequest(const string& name, T& reply, const string& namespace_,
+                                            const chrono::nanoseconds& timeout, int64_t* version = nullptr);
+    template<class T>
     ParameterStatus                         getRemoteRequest(const string& name, void(*cb)(const T), const string& namespace_);
+    void                                    unwatchRemoteRequest(const string& name, const string& namespace_);
+    ParamBatchReply                         batchRemoteRequest(const ParamBatchRequest& request, const string& namespace_);
 
     private:
+    shared_ptr<ParamRPCClient>              client(const string& namespace_, const chrono::steady_clock::time_point& deadline);
     ClientClub                              clients;
     shared_mutex                            mtx;
+    condition_variable_any                  clients_cv;     // a client was added
     getRequestQueue                         get_requests_queue;       
+    shared_ptr<WorkerPool>                  dispatcher;     // one thread for the dynamic callbacks of every remote parameter
 };
 
 template<class T>
@@ -218,16 +479,22 @@ ParameterStatus ParamRPCClientClub::setRemoteRequest(const string& name, const T
 
 template<class T>
 ParameterStatus ParamRPCClientClub::getRemoteRequest(const string& name, T& reply, const string& namespace_) {
-    unique_lock<shared_mutex> lock(mtx);
-    getParamRPCRequest request_;
-    request_.set_name(name);
-    if (!clients.count(namespace_)) {
-        return ParameterStatus::TMEP_NOT_AVALIABLE;
-    }
+    return getRemoteRequest(name, reply, namespace_, chrono::nanoseconds(0));
+}
+
+template<class T>
+ParameterStatus ParamRPCClientClub::getRemoteRequest(const string& name, T& reply, const string& namespace_,
+    const chrono::nanoseconds& timeout, int64_t* version) {
+    // no lock of the club is held while waiting, the client is kept alive by its pointer
+    const auto deadline = chrono::steady_clock::now() + timeout;
+    shared_ptr<ParamRPCClient> client_ = client(namespace_, deadline);
+    if (!client_) return ParameterStatus::TMEP_NOT_AVALIABLE;
     getParamRPCReply reply_;
-    clients[namespace_]->getRemoteParam(request_, reply_);
-    reply_.mutable_payload()->UnpackTo(&reply);
-    return reply_.status();
+    const int64_t known = version ? *version : 0;
+    ParameterStatus status = client_->getRemoteParam(name, reply_, deadline, version);
+    if (status != ParameterStatus::NORMAL || (version && *version == known && known != 0)) return status;
+    if (!reply_.payload().UnpackTo(&reply)) return ParameterStatus::TYPE_MISMATCH;
+    return status;
 }
 
 template<class T>
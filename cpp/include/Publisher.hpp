@@ -6,13 +6,19 @@ namespace core {
     template<typename T>
     class Publisher {
         public:
+        using SubscriberCallback = function<void(const int)>; // called with the number of subscribers after the change
         Publisher(const string& topic, shared_ptr<core::NodeHandler> nh);
         void                                publish(const T& msg, bool cache = false);
+        int                                 getNumSubscribers();
+        bool                                hasSubscribers();
+        void                                onSubscribe(SubscriberCallback cb);
+        void                                onUnsubscribe(SubscriberCallback cb);
         void                                shutdown();
         private:
         shared_ptr<core::NodeHandler>       nh_;
         const string                        pub_topic;
+        shared_ptr<topic_writer>            writer_;
     };
 }
 
-#endif
\ No newline at end of file
+#endif
@@ -1,6 +1,11 @@
 #ifndef SERVICE_CLIENT_HPP
 #define SERVICE_CLIENT_HPP
 #include "service.grpc.pb.h"
+#include "LocalService.hpp"
+#include "WorkerPool.hpp"
+#include "Coroutine.hpp"
+#include "LatencyHistogram.hpp"
+#include <map>
 
 namespace core {
 
@@ -11,49 +16,119 @@ public:
     }
 };
 
+class ServiceOverloadedException : public std::exception {
+public:
+    const char* what() const noexcept override {
+        return "service server is overloaded, the request was not started.";
+    }
+};
+
+class ServiceTimeoutException : public std::exception {
+public:
+    const char* what() const noexcept override {
+        return "service request passed its deadline.";
+    }
+};
+
+/*
+Calls one service on every server of it, each request goes to the server with the fewest outstanding ones, over
+a unix socket on the same host and grpc otherwise. Requests are pipelined and matched to their replies by id,
+each returns a future or is co_awaited, and fails with one of the exceptions above instead of a reply.
+*/
 template<typename Request, typename Reply>
 class ServiceClient {
     using Stream = unique_ptr<ClientReaderWriter<ServiceRPCRequest, ServiceRPCReply> >;
     using ClientStub = unique_ptr<service_rpc::ServiceRPC::Stub>;
     public:
-    ServiceClient(const string& service, future<string>& received_server_request, shared_ptr<core::NodeHandler> nh) ;
+    ServiceClient(const string& service, shared_ptr<core::NodeHandler> nh, shared_ptr<WorkerPool> pool) ;
+    ~ServiceClient();
     bool                                request(const Request& request, future<Reply>& reply);
-    bool                                cancel();
+    bool                                request(const Request& request, future<Reply>& reply, uint64_t& request_id);
+    bool                                request(const Request& request, future<Reply>& reply, uint64_t& request_id, const chrono::milliseconds& timeout);
+    bool                                requestBatch(const vector<Request>& requests, vector<future<Reply>>& replies);  // one write to one server
+    [[nodiscard]] ReplyAwaiter<Reply>   request(const Request& request);
+    [[nodiscard]] ReplyAwaiter<Reply>   request(const Request& request, CancellationToken token); // the request is canceled with the token
+    [[nodiscard]] ReplyAwaiter<Reply>   request(const Request& request, CancellationToken token, const chrono::milliseconds& timeout);
+    void                                setTimeout(const chrono::milliseconds& timeout);   // of requests without one, 0 for none
+    ServiceLatency                      latency();  // queue and execute time reported by the servers, transport in between
+    bool                                cancel();   // cancel every outstanding request
+    bool                                cancel(const uint64_t& request_id);
+    int                                 outstanding();
+    int                                 servers();  // connected servers
     ServiceCallStatus                   ServerStatus();
-    void                                reset();
+    void                                reset();    // reconnect to every known server
+    // runs on the reader thread of the server, a slow callback makes the server merge the feedback it has not sent yet
+    template<typename Feedback>
+    void                                onFeedback(function<void(const uint64_t& request_id, const Feedback& feedback)> cb);
 
     private:
+    struct server_info {
+        string                          srv_addr;
+        unique_ptr<ClientContext>       context_;
+        shared_ptr<grpc::Channel>       channel;
+        ClientStub                      stub_;
+        Stream                          stream_;
+        unique_ptr<LocalServiceClient>  local_;     // set when the server is reached over its local socket
+        atomic<bool>                    connected {false};
+        atomic<bool>                    closed {false};
+        atomic<int>                     outstanding {0};
+        mutex                           write_mtx;  // a sync stream takes one writer at a time, guards the connection
+        thread                          reader;
+    };
+    struct pending_call {
+        promise<Reply>                  reply;
+        typename ReplyAwaiter<Reply>::ReplyHandler on_reply;   // set for co_awaited requests instead of the promise
+        shared_ptr<server_info>         server;
+        chrono::steady_clock::time_point sent;
+        bool                            writing = false;    // left to send_request by a closing stream
+        function<void()>                unregister;         // removes the cancel callback of a co_awaited request
+    };
     ServiceCallStatus                   status;
     shared_mutex                        status_mtx;
     shared_ptr<core::NodeHandler>       nh_;
     const string                        service_name;
-    unique_ptr<ClientContext>           context_;
-    Stream                              stream_;
-    ClientStub                          stub_;
-    shared_ptr<grpc::Channel>           channel;
-    thread                              wait_server_notify_thread;
-    atomic<bool>                        connected;  
-    atomic<bool>                        requested;  
-    promise<Reply>                      reply_promise;
-
-    shared_mutex                        usr_operation_mtx;
+    shared_ptr<WorkerPool>              pool_;      // resumes awaiting coroutines, the reader thread does if null
+    uint64_t                            watch_id = 0;
+    vector<shared_ptr<server_info>>     servers_;
+    shared_mutex                        servers_mtx;
+    atomic<size_t>                      round_robin {0};
+    atomic<uint64_t>                    next_request_id {1};
+    unordered_map<uint64_t, pending_call> reply_promises;
+    mutex                               reply_promises_mtx;
+    atomic<int64_t>                     default_timeout_ms {0};
+    multimap<chrono::steady_clock::time_point, uint64_t> deadlines;    // may hold requests already replied
+    unordered_map<uint64_t, const server_info*> timed_out;  // and the server they went to, their late replies are dropped quietly
+    condition_variable                  deadline_cv;
+    bool                                stopping = false;   // deadlines, timed_out and stopping are guarded by reply_promises_mtx
+    thread                              deadline_thread;
+    LatencyHistogram                    queue_latency;
+    LatencyHistogram                    execute_latency;
+    LatencyHistogram                    transport_latency;
+    LatencyHistogram                    total_latency;
+    function<void(const uint64_t&, const string&)> feedback_cb;   // takes the serialized feedback
+    shared_mutex                        feedback_mtx;
 
-    future<string>                      wait_server_addr;
-    ServiceRPCRequest                   request_;
-    ServiceRPCReply                     response_; 
-    grpc::Status                        rpc_status;
-    void                                create_connection(const string& srv_addr);
+    void                                watch_servers();
+    void                                add_server(const string& srv_addr);
+    void                                close_servers();
+    shared_ptr<server_info>             pick_server();
+    void                                create_connection(shared_ptr<server_info> server);
+    bool                                connect_local(server_info& server);
+    bool                                send_request(const Request& request, pending_call& call, uint64_t& request_id, const chrono::milliseconds& timeout);
+    void                                expire_requests();
+    void                                resolve(const uint64_t& request_id, Reply reply, exception_ptr error = nullptr, const int64_t& queue_us = 0, const int64_t& execute_us = 0);
+    void                                deliver(pending_call call, Reply reply, exception_ptr error);
+    void                                feedback(const uint64_t& request_id, const string& feedback_msg);
+    void                                close_server(server_info& server);
+    bool                                write_batch(server_info& server, const uint64_t& first_id, const vector<Request>& requests, const chrono::milliseconds& timeout);
+    bool                                write_request(server_info& server, const uint64_t& request_id, const ServiceRPCRequest::ServiceRPCSetting setting, const Request* payload = nullptr,
+                                            const chrono::milliseconds& timeout = chrono::milliseconds(0));
 };
 
 template<typename Request, typename Reply>
-ServiceClient<Request, Reply>::ServiceClient(const string& service, future<string>& received_server_request, shared_ptr<core::NodeHandler> nh) 
-: nh_(nh), service_name(service), wait_server_addr(move(received_server_request)) {
-    connected = false;
-    wait_server_notify_thread = thread([this]() mutable {
-        const string srv_addr = wait_server_addr.get();
-        create_connection(srv_addr);
-    });
-    
+ServiceClient<Request, Reply>::ServiceClient(const string& service, shared_ptr<core::NodeHandler> nh, shared_ptr<WorkerPool> pool)
+: nh_(nh), service_name(service), pool_(pool) {
+    watch_servers();
 }
 template<typename Request, typename Reply>
 ServiceCallStatus ServiceClient<Request, Reply>::ServerStatus() {
@@ -61,67 +136,447 @@ ServiceCallStatus ServiceClient<Request, Reply>::ServerStatus() {
     return status;
 }
 template<typename Request, typename Reply>
+int ServiceClient<Request, Reply>::outstanding() {
+    unique_lock<mutex> lock(reply_promises_mtx);
+    return reply_promises.size();
+}
+template<typename Request, typename Reply>
+int ServiceClient<Request, Reply>::servers() {
+    shared_lock<shared_mutex> lock(servers_mtx);
+    int count = 0;
+    for (auto &server: servers_) count += server->connected.load();
+    return count;
+}
+template<typename Request, typename Reply>
+void ServiceClient<Request, Reply>::add_server(const string& srv_addr) {
+    vector<shared_ptr<server_info>> finished;
+    {
+        unique_lock<shared_mutex> lock(servers_mtx);
+        for (auto it = servers_.begin(); it != servers_.end();) {
+            if ((*it)->closed.load()) {
+                finished.push_back(*it);
+                it = servers_.erase(it);
+            } else if ((*it)->srv_addr == srv_addr) {
+                return;
+            } else it++;
+        }
+        auto server = make_shared<server_info>();
+        server->srv_addr = srv_addr;
+        servers_.push_back(server);
+        server->reader = thread(&ServiceClient<Request, Reply>::create_connection, this, server);
+    }
+    for (auto &server: finished) server->reader.join();
+}
+template<typename Request, typename Reply>
+void ServiceClient<Request, Reply>::close_servers() {
+    vector<shared_ptr<server_info>> servers;
+    {
+        unique_lock<shared_mutex> lock(servers_mtx);
+        servers.swap(servers_);
+    }
+    for (auto &server: servers) {
+        {
+            unique_lock<mutex> lock(server->write_mtx);
+            server->connected = false;
+            server->closed = true;
+            if (server->local_) server->local_->disconnect();
+            else if (server->context_) server->context_->TryCancel();
+        }
+        server->reader.join();
+    }
+}
+template<typename Request, typename Reply>
+shared_ptr<typename ServiceClient<Request, Reply>::server_info> ServiceClient<Request, Reply>::pick_server() {
+    shared_lock<shared_mutex> lock(servers_mtx);
+    shared_ptr<server_info> picked;
+    const size_t count = servers_.size();
+    const size_t start = round_robin++;
+    for (size_t i = 0; i < count; i++) {
+        const shared_ptr<server_info>& server = servers_[(start + i) % count];
+        if (!server->connected.load()) continue;
+        if (!picked || server->outstanding.load() < picked->outstanding.load()) picked = server;
+    }
+    return picked;
+}
+template<typename Request, typename Reply>
+bool ServiceClient<Request, Reply>::write_request(server_info& server, const uint64_t& request_id, const ServiceRPCRequest::ServiceRPCSetting setting, const Request* payload,
+const chrono::milliseconds& timeout) {
+    const int64_t timeout_us = chrono::duration_cast<chrono::microseconds>(timeout).count();
+    unique_lock<mutex> lock(server.write_mtx);
+    if (!server.connected.load()) return false;
+    if (server.local_) return server.local_->write(request_id, setting, payload ? serialize(*payload) : string(4, '\0'), timeout_us);
+    ServiceRPCRequest request;
+    request.set_setting(setting);
+    request.set_request_id(request_id);
+    request.set_timeout_us(timeout_us);
+    if (payload) request.mutable_payload()->PackFrom(*payload);
+    return server.stream_->Write(request);
+}
+template<typename Request, typename Reply>
+bool ServiceClient<Request, Reply>::write_batch(server_info& server, const uint64_t& first_id, const vector<Request>& requests, const chrono::milliseconds& timeout) {
+    const int64_t timeout_us = chrono::duration_cast<chrono::microseconds>(timeout).count();
+    unique_lock<mutex> lock(server.write_mtx);
+    if (!server.connected.load()) return false;
+    if (server.local_) {
+        // one length prefixed message holding the length prefixed requests
+        string batch(4, '\0');
+        for (auto &request: requests) batch += serialize(request);
+        google::protobuf::io::CodedOutputStream::WriteLittleEndian32ToArray(batch.size() - 4, reinterpret_cast<uint8_t*>(&batch[0]));
+        return server.local_->write(first_id, ServiceRPCRequest::PULL_BATCH, batch, timeout_us);
+    }
+    ServiceRPCRequest request;
+    request.set_setting(ServiceRPCRequest::PULL_BATCH);
+    request.set_request_id(first_id);
+    request.set_timeout_us(timeout_us);
+    for (auto &request_: requests) request_.SerializeToString(request.add_batch());
+    return server.stream_->Write(request);
+}
+template<typename Request, typename Reply>
+bool ServiceClient<Request, Reply>::cancel(const uint64_t& request_id) {
+    shared_ptr<server_info> server;
+    {
+        unique_lock<mutex> lock(reply_promises_mtx);
+        auto it = reply_promises.find(request_id);
+        if (it == reply_promises.end()) return false;
+        server = it->second.server;
+    }
+    return write_request(*server, request_id, ServiceRPCRequest::SET_CANCELED);
+}
+template<typename Request, typename Reply>
 bool ServiceClient<Request, Reply>::cancel() {
-    unique_lock<shared_mutex> lock(usr_operation_mtx);
-    if (!connected.load() || !requested.load()) return false;
-    ServiceRPCRequest cancel_call;
-    cancel_call.set_setting(ServiceRPCRequest::SET_CANCELED);
-    if (stream_->Write(cancel_call)) {
-        return true;
-    }
-    wait_server_notify_thread.join();
-    return false;
+    vector<uint64_t> request_ids;
+    {
+        unique_lock<mutex> lock(reply_promises_mtx);
+        for (auto &pending: reply_promises) request_ids.push_back(pending.first);
+    }
+    bool canceled = false;
+    for (auto id: request_ids) canceled = cancel(id) || canceled;
+    return canceled;
 }
 template<typename Request, typename Reply>
 bool ServiceClient<Request, Reply>::request(const Request& request, future<Reply>& reply) {
-    unique_lock<shared_mutex> lock(usr_operation_mtx);
-    if (!connected.load() || requested.load()) return false;
-    request_.set_setting(ServiceRPCRequest::PULL_NEW_REQ);
-    request_.mutable_payload()->PackFrom(request);
-    if (stream_->Write(request_)) {
-        requested = true;
-        reply = move(reply_promise.get_future());
-        return true;
-    }
-    wait_server_notify_thread.join();
+    uint64_t request_id;
+    return this->request(request, reply, request_id);
+}
+template<typename Request, typename Reply>
+bool ServiceClient<Request, Reply>::request(const Request& request, future<Reply>& reply, uint64_t& request_id) {
+    return this->request(request, reply, request_id, chrono::milliseconds(default_timeout_ms.load()));
+}
+template<typename Request, typename Reply>
+bool ServiceClient<Request, Reply>::request(const Request& request, future<Reply>& reply, uint64_t& request_id, const chrono::milliseconds& timeout) {
+    pending_call call;
+    reply = call.reply.get_future();
+    return send_request(request, call, request_id, timeout);
+}
+template<typename Request, typename Reply>
+bool ServiceClient<Request, Reply>::requestBatch(const vector<Request>& requests, vector<future<Reply>>& replies) {
+    replies.clear();
+    if (requests.empty()) return true;
+    const chrono::milliseconds timeout(default_timeout_ms.load());
+    while (shared_ptr<server_info> server = pick_server()) {
+        const uint64_t first_id = next_request_id.fetch_add(requests.size());
+        const chrono::steady_clock::time_point sent = chrono::steady_clock::now();
+        {
+            unique_lock<mutex> lock(reply_promises_mtx);
+            for (size_t i = 0; i < requests.size(); i++) {
+                pending_call call;
+                call.server = server;
+                call.sent = sent;
+                replies.push_back(call.reply.get_future());
+                reply_promises.emplace(first_id + i, move(call));
+                if (timeout.count() > 0) deadlines.emplace(sent + timeout, first_id + i);
+            }
+            if (timeout.count() > 0) {
+                if (!deadline_thread.joinable()) deadline_thread = thread(&ServiceClient<Request, Reply>::expire_requests, this);
+                deadline_cv.notify_one();
+            }
+        }
+        server->outstanding += requests.size();
+        if (write_batch(*server, first_id, requests, timeout)) return true;
+        server->outstanding -= requests.size();
+        server->connected = false;
+        replies.clear();
+        // the promises not failed by the closing stream are dropped, a future of them would never be set
+        unique_lock<mutex> lock(reply_promises_mtx);
+        for (size_t i = 0; i < requests.size(); i++) reply_promises.erase(first_id + i);
+    }
+    return false;
+}
+template<typename Request, typename Reply>
+ReplyAwaiter<Reply> ServiceClient<Request, Reply>::request(const Request& request) {
+    return this->request(request, CancellationToken());
+}
+template<typename Request, typename Reply>
+ReplyAwaiter<Reply> ServiceClient<Request, Reply>::request(const Request& request, CancellationToken token) {
+    return this->request(request, token, chrono::milliseconds(default_timeout_ms.load()));
+}
+template<typename Request, typename Reply>
+ReplyAwaiter<Reply> ServiceClient<Request, Reply>::request(const Request& request, CancellationToken token, const chrono::milliseconds& timeout) {
+    return ReplyAwaiter<Reply>([this, request, token, timeout](typename ReplyAwaiter<Reply>::ReplyHandler on_reply) mutable {
+        pending_call call;
+        call.on_reply = move(on_reply);
+        uint64_t request_id;
+        if (!send_request(request, call, request_id, timeout)) {
+            return deliver(move(call), Reply(), make_exception_ptr(StreamCloseException()));
+        }
+        const uint64_t registration = token.on_cancel([this, request_id]() {cancel(request_id);});
+        if (!registration) return;
+        {
+            // removed by deliver, unless the reply was delivered before the registration
+            unique_lock<mutex> lock(reply_promises_mtx);
+            auto it = reply_promises.find(request_id);
+            if (it != reply_promises.end()) {
+                it->second.unregister = [token, registration]() mutable {token.remove_on_cancel(registration);};
+                return;
+            }
+        }
+        token.remove_on_cancel(registration);
+    });
+}
+template<typename Request, typename Reply>
+void ServiceClient<Request, Reply>::setTimeout(const chrono::milliseconds& timeout) {
+    default_timeout_ms = timeout.count();
+}
+template<typename Request, typename Reply>
+ServiceLatency ServiceClient<Request, Reply>::latency() {
+    ServiceLatency latency_;
+    latency_.queue = queue_latency.snapshot();
+    latency_.execute = execute_latency.snapshot();
+    latency_.transport = transport_latency.snapshot();
+    latency_.total = total_latency.snapshot();
+    return latency_;
+}
+template<typename Request, typename Reply>
+bool ServiceClient<Request, Reply>::send_request(const Request& request, pending_call& call, uint64_t& request_id, const chrono::milliseconds& timeout) {
+    // a server whose stream broke under the write is skipped, the request goes to the next one
+    while (shared_ptr<server_info> server = pick_server()) {
+        request_id = next_request_id++;
+        call.server = server;
+        call.sent = chrono::steady_clock::now();
+        call.writing = true;
+        {
+            // registered before the write, the reply may arrive before Write returns
+            unique_lock<mutex> lock(reply_promises_mtx);
+            reply_promises.emplace(request_id, move(call));
+            if (timeout.count() > 0) {
+                deadlines.emplace(chrono::steady_clock::now() + timeout, request_id);
+                if (!deadline_thread.joinable()) deadline_thread = thread(&ServiceClient<Request, Reply>::expire_requests, this);
+                deadline_cv.notify_one();
+            }
+        }
+        server->outstanding++;
+        const bool written = write_request(*server, request_id, ServiceRPCRequest::PULL_NEW_REQ, &request, timeout);
+        unique_lock<mutex> lock(reply_promises_mtx);
+        auto it = reply_promises.find(request_id);
+        // already replied or timed out
+        if (it == reply_promises.end()) return true;
+        it->second.writing = false;
+        if (written && !server->closed.load()) return true;
+        pending_call sent_call = move(it->second);
+        reply_promises.erase(it);
+        if (written) {
+            // the stream closed after the request went out, it may have run
+            lock.unlock();
+            deliver(move(sent_call), Reply(), make_exception_ptr(StreamCloseException()));
+            return true;
+        }
+        server->outstanding--;
+        server->connected = false;
+        call = move(sent_call);
+    }
     return false;
 }
 
 template<typename Request, typename Reply>
-void ServiceClient<Request, Reply>::create_connection(const string& srv_addr) {
-    context_ = make_unique<ClientContext>();
-    channel = CreateChannel(srv_addr, InsecureChannelCredentials());
-    stub_ = service_rpc::ServiceRPC::NewStub(channel);
-    stream_ = stub_->ServicePullRequest(context_.get());
-    reply_promise = promise<Reply>();
-    connected = true;
-    requested = false;
-    while (core::ok()) {
-        if (stream_->Read(&response_)) {
-            unique_lock<shared_mutex> lock(status_mtx);
-            status = response_.status();
-            if (status == ServiceRPCReply::SUCCESS || 
-            status == ServiceRPCReply::FAILED || 
-            status == ServiceRPCReply::ABORTED) {
-                Reply reply;
-                response_.payload().UnpackTo(&reply);
-                reply_promise.set_value(reply);
-                reply_promise = promise<Reply>();
-                requested = false;
+void ServiceClient<Request, Reply>::expire_requests() {
+    unique_lock<mutex> lock(reply_promises_mtx);
+    while (!stopping) {
+        if (deadlines.empty()) deadline_cv.wait(lock);
+        else deadline_cv.wait_until(lock, deadlines.begin()->first);
+        const chrono::steady_clock::time_point now = chrono::steady_clock::now();
+        vector<pair<uint64_t, pending_call>> expired;
+        while (!deadlines.empty() && deadlines.begin()->first <= now) {
+            const uint64_t request_id = deadlines.begin()->second;
+            deadlines.erase(deadlines.begin());
+            auto it = reply_promises.find(request_id);
+            if (it == reply_promises.end()) continue;
+            it->second.server->outstanding--;
+            expired.emplace_back(request_id, move(it->second));
+            reply_promises.erase(it);
+            timed_out.emplace(request_id, it->second.server.get());
+        }
+        if (expired.empty()) continue;
+        lock.unlock();
+        // the server may still be running it, cancel so it can stop early
+        for (auto &call: expired) {
+            write_request(*call.second.server, call.first, ServiceRPCRequest::SET_CANCELED);
+            deliver(move(call.second), Reply(), make_exception_ptr(ServiceTimeoutException()));
+        }
+        lock.lock();
+    }
+}
+template<typename Request, typename Reply>
+void ServiceClient<Request, Reply>::resolve(const uint64_t& request_id, Reply reply, exception_ptr error, const int64_t& queue_us, const int64_t& execute_us) {
+    pending_call call;
+    {
+        unique_lock<mutex> lock(reply_promises_mtx);
+        auto it = reply_promises.find(request_id);
+        if (it == reply_promises.end()) {
+            if (!timed_out.erase(request_id)) LOG(WARNING) << "reply of unknown request " << request_id;
+            return;
+        }
+        it->second.server->outstanding--;
+        call = move(it->second);
+        reply_promises.erase(it);
+    }
+    if (!error) {
+        // calls that never ran are left out, they would skew the execute time
+        const chrono::nanoseconds total = chrono::steady_clock::now() - call.sent;
+        queue_latency.record(chrono::microseconds(queue_us));
+        execute_latency.record(chrono::microseconds(execute_us));
+        transport_latency.record(total - chrono::microseconds(queue_us + execute_us));
+        total_latency.record(total);
+    }
+    deliver(move(call), move(reply), error);
+}
+template<typename Request, typename Reply>
+void ServiceClient<Request, Reply>::deliver(pending_call call, Reply reply, exception_ptr error) {
+    if (call.unregister) call.unregister();
+    if (!call.on_reply) {
+        if (error) call.reply.set_exception(error);
+        else call.reply.set_value(move(reply));
+        return;
+    }
+    // the awaiting coroutine may run for long or send requests, never on the reader thread with its locks
+    auto resume = [on_reply = move(call.on_reply), reply = move(reply), error]() {on_reply(reply, error);};
+    // a full pool cannot refuse a resume, it runs here instead
+    if (!pool_ || !pool_->post(resume)) resume();
+}
+template<typename Request, typename Reply>
+template<typename Feedback>
+void ServiceClient<Request, Reply>::onFeedback(function<void(const uint64_t& request_id, const Feedback& feedback)> cb) {
+    unique_lock<shared_mutex> lock(feedback_mtx);
+    if (!cb) {
+        feedback_cb = nullptr;
+        return;
+    }
+    feedback_cb = [cb](const uint64_t& request_id, const string& feedback_msg) {
+        Feedback feedback_;
+        if (!feedback_.ParseFromString(feedback_msg)) {
+            LOG(WARNING) << "feedback of request " << request_id << " is not a " << Feedback::descriptor()->full_name();
+            return;
+        }
+        cb(request_id, feedback_);
+    };
+}
+template<typename Request, typename Reply>
+void ServiceClient<Request, Reply>::feedback(const uint64_t& request_id, const string& feedback_msg) {
+    function<void(const uint64_t&, const string&)> cb;
+    {
+        shared_lock<shared_mutex> lock(feedback_mtx);
+        cb = feedback_cb;
+    }
+    if (!cb) return;
+    {
+        // feedback sent just before the reply may arrive after it
+        unique_lock<mutex> lock(reply_promises_mtx);
+        if (!reply_promises.count(request_id)) return;
+    }
+    cb(request_id, feedback_msg);
+}
+template<typename Request, typename Reply>
+void ServiceClient<Request, Reply>::close_server(server_info& server) {
+    LOG(INFO) << "service server stream closed: " << service_name << "@" << server.srv_addr;
+    server.connected = false;
+    server.closed = true;
+    // the requests may have run already, so they are failed rather than sent again,
+    // one still being written is left to send_request, which tries the next server if the write failed
+    vector<pending_call> failed;
+    {
+        unique_lock<mutex> lock(reply_promises_mtx);
+        for (auto it = reply_promises.begin(); it != reply_promises.end();) {
+            if (it->second.server.get() != &server || it->second.writing) {
+                it++;
+                continue;
+            }
+            failed.push_back(move(it->second));
+            it = reply_promises.erase(it);
+        }
+        // no late reply comes over a closed stream
+        for (auto it = timed_out.begin(); it != timed_out.end();) {
+            if (it->second == &server) it = timed_out.erase(it);
+            else it++;
+        }
+        server.outstanding = 0;
+    }
+    for (auto &call: failed) deliver(move(call), Reply(), make_exception_ptr(StreamCloseException()));
+}
+template<typename Request, typename Reply>
+void ServiceClient<Request, Reply>::create_connection(shared_ptr<server_info> server) {
+    if (connect_local(*server)) {
+        uint64_t request_id;
+        int32_t code;
+        string msg;
+        int64_t queue_us, execute_us;
+        while (core::ok() && server->local_->read(request_id, code, msg, queue_us, execute_us)) {
+            const ServiceCallStatus call_status = static_cast<ServiceCallStatus>(code);
+            if (call_status == ServiceRPCReply::FEEDBACK) {
+                feedback(request_id, msg);
+                continue;
+            }
+            {
+                unique_lock<shared_mutex> lock(status_mtx);
+                status = call_status;
             }
-        } else {
-            LOG(INFO) << "service server stream closed";
-            if (requested.load()) {
-                reply_promise.set_exception(make_exception_ptr(StreamCloseException()));
+            if (call_status == ServiceRPCReply::OVERLOADED) {
+                resolve(request_id, Reply(), make_exception_ptr(ServiceOverloadedException()));
+            } else if (call_status == ServiceRPCReply::DEADLINE_EXCEEDED) {
+                resolve(request_id, Reply(), make_exception_ptr(ServiceTimeoutException()));
+            } else if (call_status == ServiceRPCReply::SUCCESS ||
+            call_status == ServiceRPCReply::FAILED ||
+            call_status == ServiceRPCReply::ABORTED) {
+                Reply reply;
+                reply.ParseFromString(msg);
+                resolve(request_id, move(reply), nullptr, queue_us, execute_us);
             }
-            reply_promise = promise<Reply>();
-            connected = false;
-            requested = false;
-            return ;
+        }
+        return close_server(*server);
+    }
+    {
+        unique_lock<mutex> lock(server->write_mtx);
+        if (server->closed.load()) return;
+        server->context_ = make_unique<ClientContext>();
+        server->channel = CreateChannel(server->srv_addr, InsecureChannelCredentials());
+        server->stub_ = service_rpc::ServiceRPC::NewStub(server->channel);
+        server->stream_ = server->stub_->ServicePullRequest(server->context_.get());
+        server->connected = true;
+    }
+    ServiceRPCReply response_;
+    while (core::ok() && server->stream_->Read(&response_)) {
+        const ServiceCallStatus call_status = response_.status();
+        if (call_status == ServiceRPCReply::FEEDBACK) {
+            feedback(response_.request_id(), response_.payload().value());
+            continue;
+        }
+        {
+            unique_lock<shared_mutex> lock(status_mtx);
+            status = call_status;
+        }
+        if (call_status == ServiceRPCReply::OVERLOADED) {
+            resolve(response_.request_id(), Reply(), make_exception_ptr(ServiceOverloadedException()));
+        } else if (call_status == ServiceRPCReply::DEADLINE_EXCEEDED) {
+            resolve(response_.request_id(), Reply(), make_exception_ptr(ServiceTimeoutException()));
+        } else if (call_status == ServiceRPCReply::SUCCESS ||
+        call_status == ServiceRPCReply::FAILED ||
+        call_status == ServiceRPCReply::ABORTED) {
+            Reply reply;
+            response_.payload().UnpackTo(&reply);
+            resolve(response_.request_id(), move(reply), nullptr, response_.queue_us(), response_.execute_us());
         }
     }
+    close_server(*server);
 }
 
 }
 
-#endif
\ No newline at end of file
+#endif
@@ -1,6 +1,13 @@
 #include "service.grpc.pb.h"
+#include "WorkerPool.hpp"
+#include "LocalService.hpp"
+#include "Coroutine.hpp"
+#include "LatencyHistogram.hpp"
 #include <queue>
+#include <deque>
+#include <list>
 #include <future>
+#include <chrono>
 namespace core {
 struct ServerServiceType {
     enum CompletionQueueType { READ = 1, WRITE = 2, BROKEN_PIPE = -1, CONNECT = 0};
@@ -10,153 +17,347 @@ struct ServerServiceType {
 using service_rpc::ServiceRPCReply;
 using service_rpc::ServiceRPCRequest;
 using ServiceCallStatus = service_rpc::ServiceRPCReply_ServiceRPCStatus;
+struct ServiceServerStats {
+    int                                 running = 0;
+    int                                 queue_depth = 0;
+    uint64_t                            received = 0;   // every call, also those answered from the cache or collapsed
+    uint64_t                            rejected = 0;   // replied with OVERLOADED
+    double                              reject_rate = 0;
+    uint64_t                            cache_hits = 0;
+    uint64_t                            collapsed = 0;  // calls that waited on an identical running call
+};
+/*
+Serves one service over grpc streams, and over a LocalServiceServer to clients of the same host. Each request is
+a call with its own id, which the callbacks and status functions take. Calls run on the worker pool or as
+coroutines, and may be admitted, cached, batched, given a deadline or canceled through their token.
+*/
 template<typename Request, typename Reply>
 class ServiceServer final : public service_rpc::ServiceRPC::AsyncService {
     public:
     using FunctionType = void(*)(const Request*, Reply*, ServiceServer<Request, Reply>*, const int&);
+    using AsyncFunctionType = ServiceTask(*)(const Request*, Reply*, ServiceServer<Request, Reply>*, const int, CancellationToken);
+    // one reply and one call id per request, the status of each call is set as for a single call
+    using BatchFunctionType = void(*)(const vector<Request>&, vector<Reply>&, ServiceServer<Request, Reply>*, const vector<int>&);
     using Stream = unique_ptr<ServerAsyncReaderWriter<ServiceRPCReply, ServiceRPCRequest> >;
     ServiceServer() = default;
-    ServiceServer(const string& service, const string& ip, int& rpc_port, FunctionType cb, shared_ptr<core::NodeHandler> nh);
+    ServiceServer(const string& service, const string& ip, int& rpc_port, FunctionType cb, shared_ptr<core::NodeHandler> nh, shared_ptr<WorkerPool> pool);
+    ServiceServer(const string& service, const string& ip, int& rpc_port, AsyncFunctionType cb, shared_ptr<core::NodeHandler> nh, shared_ptr<WorkerPool> pool);
+    ~ServiceServer();
     bool                                valid();
-    bool                                isPrompted(const int& stream_id);
-    bool                                isAborted(const int& stream_id);
-    void                                setAborted(const int& stream_id);
-    void                                setSuccess(const int& stream_id);
-    void                                setFailed(const int& stream_id);
+    CancellationToken                   token(const int& call_id);
+    void                                setBatchHandler(BatchFunctionType cb);  // a client batch runs in one call taking one admission slot
+    // at most max_concurrency calls run, the others wait in the queue or are rejected with OVERLOADED
+    void                                setAdmission(const int& max_concurrency, const int& max_queue, const chrono::milliseconds& queue_timeout);
+    ServiceServerStats                  stats();
+    // successful replies by request bytes, an equal request waits for a running call, 0 entries disables
+    void                                setCache(const size_t& max_entries, const chrono::milliseconds& ttl);
+    void                                invalidateCache();
+    void                                invalidateCache(const Request& request);
+    template<typename Feedback>
+    bool                                publishFeedback(const int& call_id, const Feedback& feedback);    // false if the call is not running
+    bool                                isPrompted(const int& call_id);
+    bool                                isAborted(const int& call_id);
+    bool                                isExpired(const int& call_id);
+    chrono::steady_clock::time_point    deadline(const int& call_id);   // time_point::max() without a deadline
+    ServiceLatency                      latency();
+    void                                setAborted(const int& call_id);
+    void                                setSuccess(const int& call_id);
+    void                                setFailed(const int& call_id);
     private:
+    ServiceServer(const string& service, const string& ip, int& rpc_port, FunctionType cb, AsyncFunctionType async_cb, shared_ptr<core::NodeHandler> nh, shared_ptr<WorkerPool> pool);
+    struct call_info {
+        int                             stream_id;      // -1 for a call of a local connection
+        uint64_t                        request_id;
+        uint64_t                        connection = 0;
+        chrono::steady_clock::time_point received = chrono::steady_clock::now();
+        chrono::steady_clock::time_point deadline = chrono::steady_clock::time_point::max();
+    };
     shared_ptr<core::NodeHandler>       nh_;
     const string                        service_name;
     unique_ptr<ServerCompletionQueue>   cq_;
     unique_ptr<grpc::Server>            server_;
-    void                                write_reply(const ServiceRPCReply& reply, const int& stream_id);
+    void                                write_reply(const call_info& call, const ServiceCallStatus& status, const Reply* payload = nullptr,
+                                            const chrono::nanoseconds& queue_time = {}, const chrono::nanoseconds& execute_time = {});
+    void                                queue_reply(const int& stream_id, ServiceRPCReply reply);
     void                                CreateListenPort(int stream_id);
     int                                 generate_stream_id();
+    int                                 generate_call_id(const call_info& call);
     void                                handle_event(const ServerServiceType* tag);
+    void                                handle_request(const int& stream_id);
+    void                                handle_local_request(const uint64_t& connection, const uint64_t& request_id, const int32_t& setting, const int64_t& timeout_us, const char* msg, const int size);
+    void                                close_local_connection(const uint64_t& connection);
+    struct batch_item {
+        int                             call_id;
+        call_info                       call;
+        Request                         request;
+    };
+    void                                cancel_call(const call_info& call);
+    bool                                accept_call(const call_info& call, const char* bytes, const size_t size, batch_item& item);
+    void                                run_batch(vector<batch_item> items);
+    void                                run_call(const int& call_id, const call_info& call, Request request_payload);
+    void                                start_call(const int& call_id, const call_info& call, Request request_payload);
+    void                                release_call(const chrono::steady_clock::time_point& started);
+    void                                reject_call(const int& call_id, const call_info& call, const ServiceCallStatus& status);
+    // a call id looked up under recycle_mtx may be finished and handed to another call before it is used,
+    // the functions taking the expected call act only while the id still belongs to it
+    static bool                         same_call(const call_info& a, const call_info& b);
+    bool                                drop_queued(const int& call_id, const call_info* expected = nullptr);
+    bool                                abort_call(const int& call_id, const call_info* expected);
+    bool                                reply_from_cache(const string& key, const call_info& call);
+    bool                                collapse_call(const string& key, const int& call_id, const call_info& call);
+    void                                complete_cached(const int& call_id, const ServiceCallStatus& status, const Reply* payload);
+    void                                expire_queued();
+    void                                leave_task();
+    bool                                dispatch(function<void()> task);   // false if the workers refused it
+    void                                refuse_started(const vector<int>& call_ids, const vector<call_info>& calls);
+    void                                recycle_stream(const int& stream_id);
+    void                                finish_call(const int& call_id);
     vector<Stream>                      streams_;
     atomic<int>                         stream_id;
     queue<int>                          reusable_id;
+    vector<unordered_map<uint64_t, int>> stream_calls;  // stream id, request id, call id of running calls
+    vector<bool>                        closed;         // the stream closed while calls were running
+    unordered_map<uint64_t, unordered_map<uint64_t, int>> local_calls; // local connection, request id, call id
+    mutex                               recycle_mtx;    // guards reusable_id, stream_calls, closed and local_calls
     vector<unique_ptr<ServerContext>>   contexts_;
     vector<ServiceRPCRequest>           requests_;
     FunctionType                        cb_func;
+    AsyncFunctionType                   async_cb_func = nullptr;
+    atomic<BatchFunctionType>           batch_cb_func {nullptr};
     vector<ServiceCallStatus>           calls_status;
-    shared_mutex                        calls_status_mtx;
-    vector<future<void>>                future_storages;
-    vector<queue<ServiceRPCReply>>      reply_wait_queue;
+    vector<call_info>                   calls_;
+    vector<CancellationToken>           calls_token;
+    queue<int>                          reusable_call_id;
+    shared_mutex                        calls_status_mtx;   // guards calls_status, calls_, calls_token and reusable_call_id
+    shared_ptr<WorkerPool>              pool_;          // callbacks run on the completion queue thread if null
+    struct queued_call {
+        int                             call_id;
+        call_info                       call;
+        Request                         request;
+        chrono::steady_clock::time_point deadline;
+    };
+    ServiceCallStatus                   expired_status(const queued_call& call);
+    int                                 max_concurrency = 0;    // 0 admits every call at once
+    int                                 max_queue = 0;
+    chrono::milliseconds                queue_timeout {0};
+    int                                 running = 0;
+    deque<queued_call>                  queued;
+    chrono::nanoseconds                 average_call_time {0};
+    uint64_t                            received = 0;
+    uint64_t                            rejected = 0;
+    LatencyHistogram                    queue_latency;
+    LatencyHistogram                    execute_latency;
+    mutex                               admission_mtx;  // guards the admission settings, counters and queued
+    condition_variable                  admission_cv;
+    thread                              admission_thread;   // rejects queued calls at their deadline
+    bool                                stopping = false;   // guarded by admission_mtx
+    int                                 active_tasks = 0;   // started calls and batches not done yet, guarded by admission_mtx
+    condition_variable                  tasks_cv;       // signaled when active_tasks drops
+    struct cache_entry {
+        shared_ptr<const Reply>         reply;
+        chrono::steady_clock::time_point expires;
+        list<string>::iterator          lru_pos;
+    };
+    atomic<bool>                        cache_enabled {false};
+    size_t                              cache_max_entries = 0;
+    chrono::milliseconds                cache_ttl {0};
+    unordered_map<string, cache_entry>  cache_;
+    list<string>                        cache_lru;      // most recently used first
+    unordered_map<string, vector<pair<int, call_info>>> inflight;   // request bytes, calls waiting on the running one
+    unordered_map<int, pair<string, uint64_t>> inflight_keys;  // call id of a running call, its request bytes and cache generation
+    uint64_t                            cache_generation = 0;   // a reply started before an invalidation is not kept
+    uint64_t                            cache_hits = 0;
+    uint64_t                            collapsed = 0;
+    mutex                               cache_mtx;      // guards the cache settings, entries, inflight and counters
+    vector<deque<ServiceRPCReply>>      reply_wait_queue;
+    vector<bool>                        writing;        // a write of the stream is in flight
     shared_mutex                        reply_wait_queue_mtx;
     bool                                valid_ = false;
     thread                              handle_event_thread;
+    unique_ptr<LocalServiceServer>      local_;         // last, its io thread stops before the members it uses go
 
-    bool                                isSuspend(const int& stream_id);
-    bool                                isProcess(const int& stream_id);
-    void                                setProcess(const int& stream_id);
-    void                                setPrompted(const int& stream_id);
-    void                                setSuspend(const int& stream_id);
-    ServiceCallStatus                   endStatus(const int& stream_id);
+    bool                                isSuspend(const int& call_id);
+    bool                                isProcess(const int& call_id);
+    void                                setProcess(const int& call_id);
+    bool                                setPrompted(const int& call_id, const call_info* expected = nullptr);
+    ServiceCallStatus                   endStatus(const int& call_id);
 };
 
+template<typename Request, typename Reply>
+ServiceServer<Request, Reply>::~ServiceServer() {
+    deque<queued_call> dropped;
+    {
+        unique_lock<mutex> lock(admission_mtx);
+        stopping = true;
+        dropped.swap(queued);
+    }
+    admission_cv.notify_all();
+    if (admission_thread.joinable()) admission_thread.join();
+    for (auto &call: dropped) reject_call(call.call_id, call.call, ServiceRPCReply::ABORTED);
+    {
+        // calls on the worker pool hold this server, none starts once stopping is set
+        unique_lock<mutex> lock(admission_mtx);
+        tasks_cv.wait(lock, [this]() {return active_tasks == 0;});
+    }
+    local_.reset();
+    // pending streams are canceled at once, then the completion queue drains and Next returns false
+    if (server_) server_->Shutdown(chrono::system_clock::now());
+    if (cq_) cq_->Shutdown();
+    if (handle_event_thread.joinable()) handle_event_thread.join();
+}
+
 template<typename Request, typename Reply>
 bool ServiceServer<Request, Reply>::valid() {return valid_;}
 
 template<typename Request, typename Reply>
-bool ServiceServer<Request, Reply>::isSuspend(const int& stream_id) {
+CancellationToken ServiceServer<Request, Reply>::token(const int& call_id) {
     shared_lock<shared_mutex> lock(calls_status_mtx);
-    return calls_status[stream_id] == ServiceRPCReply::SUSPEND ;
+    return calls_token[call_id];
 }
 
 template<typename Request, typename Reply>
-bool ServiceServer<Request, Reply>::isPrompted(const int& stream_id) {
+bool ServiceServer<Request, Reply>::isSuspend(const int& call_id) {
     shared_lock<shared_mutex> lock(calls_status_mtx);
-    return calls_status[stream_id] == ServiceRPCReply::PROMPTED ;
+    return calls_status[call_id] == ServiceRPCReply::SUSPEND ;
 }
 
 template<typename Request, typename Reply>
-bool ServiceServer<Request, Reply>::isAborted(const int& stream_id) {
+bool ServiceServer<Request, Reply>::isPrompted(const int& call_id) {
     shared_lock<shared_mutex> lock(calls_status_mtx);
-    return calls_status[stream_id] == ServiceRPCReply::ABORTED ;
+    return calls_status[call_id] == ServiceRPCReply::PROMPTED ;
 }
 
 template<typename Request, typename Reply>
-bool ServiceServer<Request, Reply>::isProcess(const int& stream_id) {
+bool ServiceServer<Request, Reply>::isAborted(const int& call_id) {
     shared_lock<shared_mutex> lock(calls_status_mtx);
-    return calls_status[stream_id] == ServiceRPCReply::PROCESS;
+    return calls_status[call_id] == ServiceRPCReply::ABORTED ;
 }
 
 template<typename Request, typename Reply>
-void ServiceServer<Request, Reply>::setProcess(const int& stream_id) {
-    if (!isSuspend(stream_id)) return;
-    unique_lock<shared_mutex> lock(calls_status_mtx);
-    calls_status[stream_id] = ServiceRPCReply::PROCESS;
-    ServiceRPCReply reply;
-    reply.set_status(ServiceRPCReply::PROCESS);
-    write_reply(reply, stream_id);
+bool ServiceServer<Request, Reply>::isExpired(const int& call_id) {
+    return deadline(call_id) <= chrono::steady_clock::now();
 }
 
 template<typename Request, typename Reply>
-void ServiceServer<Request, Reply>::setPrompted(const int& stream_id) {
-    if (!isProcess(stream_id)) return;
-    unique_lock<shared_mutex> lock(calls_status_mtx);
-    calls_status[stream_id] = ServiceRPCReply::PROMPTED;
-    ServiceRPCReply reply;
-    reply.set_status(ServiceRPCReply::PROMPTED);
-    write_reply(reply, stream_id);
+chrono::steady_clock::time_point ServiceServer<Request, Reply>::deadline(const int& call_id) {
+    shared_lock<shared_mutex> lock(calls_status_mtx);
+    return calls_[call_id].deadline;
 }
 
 template<typename Request, typename Reply>
-void ServiceServer<Request, Reply>::setFailed(const int& stream_id) {
-    if (!isProcess(stream_id) && !isPrompted(stream_id)) return;
-    unique_lock<shared_mutex> lock(calls_status_mtx);
-    calls_status[stream_id] = ServiceRPCReply::FAILED;
+ServiceLatency ServiceServer<Request, Reply>::latency() {
+    ServiceLatency latency_;
+    latency_.queue = queue_latency.snapshot();
+    latency_.execute = execute_latency.snapshot();
+    return latency_;
 }
 
 template<typename Request, typename Reply>
-void ServiceServer<Request, Reply>::setSuccess(const int& stream_id) {
-    if (!isProcess(stream_id) && !isPrompted(stream_id)) return;
-    unique_lock<shared_mutex> lock(calls_status_mtx);
-    calls_status[stream_id] = ServiceRPCReply::SUCCESS;
+bool ServiceServer<Request, Reply>::isProcess(const int& call_id) {
+    shared_lock<shared_mutex> lock(calls_status_mtx);
+    return calls_status[call_id] == ServiceRPCReply::PROCESS;
+}
+
+template<typename Request, typename Reply>
+void ServiceServer<Request, Reply>::setProcess(const int& call_id) {
+    call_info call;
+    {
+        // never hold the status lock across a reply write
+        unique_lock<shared_mutex> lock(calls_status_mtx);
+        if (calls_status[call_id] != ServiceRPCReply::SUSPEND) return;
+        calls_status[call_id] = ServiceRPCReply::PROCESS;
+        call = calls_[call_id];
+    }
+    write_reply(call, ServiceRPCReply::PROCESS);
 }
 
 template<typename Request, typename Reply>
-void ServiceServer<Request, Reply>::setAborted(const int& stream_id) {
-    if (!isProcess(stream_id) && !isPrompted(stream_id)) return;
+bool ServiceServer<Request, Reply>::setPrompted(const int& call_id, const call_info* expected) {
+    call_info call;
+    CancellationToken call_token;
+    {
+        unique_lock<shared_mutex> lock(calls_status_mtx);
+        if (calls_status[call_id] != ServiceRPCReply::PROCESS) return false;
+        if (expected && !same_call(calls_[call_id], *expected)) return false;
+        calls_status[call_id] = ServiceRPCReply::PROMPTED;
+        call = calls_[call_id];
+        call_token = calls_token[call_id];
+    }
+    write_reply(call, ServiceRPCReply::PROMPTED);
+    call_token.cancel();
+    return true;
+}
+
+template<typename Request, typename Reply>
+void ServiceServer<Request, Reply>::setFailed(const int& call_id) {
+    if (!isProcess(call_id) && !isPrompted(call_id)) return;
     unique_lock<shared_mutex> lock(calls_status_mtx);
-    calls_status[stream_id] = ServiceRPCReply::ABORTED;
+    calls_status[call_id] = ServiceRPCReply::FAILED;
 }
 
 template<typename Request, typename Reply>
-void ServiceServer<Request, Reply>::setSuspend(const int& stream_id) {
-    if (isProcess(stream_id) || isPrompted(stream_id)) return;
+void ServiceServer<Request, Reply>::setSuccess(const int& call_id) {
+    if (!isProcess(call_id) && !isPrompted(call_id)) return;
     unique_lock<shared_mutex> lock(calls_status_mtx);
-    calls_status[stream_id] = ServiceRPCReply::SUSPEND;
+    calls_status[call_id] = ServiceRPCReply::SUCCESS;
+}
+
+template<typename Request, typename Reply>
+void ServiceServer<Request, Reply>::setAborted(const int& call_id) {
+    abort_call(call_id, nullptr);
+}
+
+template<typename Request, typename Reply>
+bool ServiceServer<Request, Reply>::abort_call(const int& call_id, const call_info* expected) {
+    CancellationToken call_token;
+    {
+        unique_lock<shared_mutex> lock(calls_status_mtx);
+        if (calls_status[call_id] != ServiceRPCReply::PROCESS && calls_status[call_id] != ServiceRPCReply::PROMPTED) return false;
+        if (expected && !same_call(calls_[call_id], *expected)) return false;
+        calls_status[call_id] = ServiceRPCReply::ABORTED;
+        call_token = calls_token[call_id];
+    }
+    call_token.cancel();
+    return true;
 }
 
 template<typename Request, typename Reply>
-ServiceCallStatus ServiceServer<Request, Reply>::endStatus(const int& stream_id) {
+bool ServiceServer<Request, Reply>::same_call(const call_info& a, const call_info& b) {
+    return a.stream_id == b.stream_id && a.request_id == b.request_id && a.connection == b.connection;
+}
+
+template<typename Request, typename Reply>
+ServiceCallStatus ServiceServer<Request, Reply>::endStatus(const int& call_id) {
     unique_lock<shared_mutex> lock(calls_status_mtx);
-    if (calls_status[stream_id] == ServiceRPCReply::SUSPEND ||
-    calls_status[stream_id] == ServiceRPCReply::PROCESS || 
-    calls_status[stream_id] == ServiceRPCReply::PROMPTED) {
+    if (calls_status[call_id] == ServiceRPCReply::SUSPEND ||
+    calls_status[call_id] == ServiceRPCReply::PROCESS || 
+    calls_status[call_id] == ServiceRPCReply::PROMPTED) {
         LOG(WARNING) << "service call back function return, but status was not manually set, auto set to aborted and reply";
-        calls_status[stream_id] = ServiceRPCReply::ABORTED;
-        return calls_status[stream_id];
+        calls_status[call_id] = ServiceRPCReply::ABORTED;
+        return calls_status[call_id];
     } else {
-        return calls_status[stream_id];
+        return calls_status[call_id];
     }
 }
 
 template<typename Request, typename Reply>
 void ServiceServer<Request, Reply>::CreateListenPort(int stream_id) {
     if (streams_.size() <= stream_id) {
+        unique_lock<shared_mutex> lock(reply_wait_queue_mtx);
         contexts_.push_back( make_unique<ServerContext>());
         streams_.push_back(make_unique<ServerAsyncReaderWriter<ServiceRPCReply, ServiceRPCRequest>>
         (ServerAsyncReaderWriter<ServiceRPCReply, ServiceRPCRequest>(contexts_[stream_id].get())));
         requests_.push_back(ServiceRPCRequest());
-        calls_status.push_back(ServiceRPCReply::SUSPEND);
-        future_storages.push_back(async([]{}));
-        reply_wait_queue.push_back(queue<ServiceRPCReply>());
+        reply_wait_queue.push_back(deque<ServiceRPCReply>());
+        writing.push_back(false);
+        unique_lock<mutex> recycle_lock(recycle_mtx);
+        stream_calls.push_back(unordered_map<uint64_t, int>());
+        closed.push_back(false);
     }
-
-    setAborted(stream_id);
-    future_storages[stream_id].get();
+    // a reused stream id is only handed out once its last callback has returned
+    unique_lock<shared_mutex> lock(reply_wait_queue_mtx);
+    writing[stream_id] = false;
+    reply_wait_queue[stream_id] = deque<ServiceRPCReply>();
     contexts_[stream_id] = make_unique<ServerContext>();
     streams_[stream_id].reset( new ServerAsyncReaderWriter<service_rpc::ServiceRPCReply, service_rpc::ServiceRPCRequest>
     (contexts_[stream_id].get()) );
@@ -168,6 +369,7 @@ void ServiceServer<Request, Reply>::CreateListenPort(int stream_id) {
 
 template<typename Request, typename Reply>
 int ServiceServer<Request, Reply>::generate_stream_id() {
+    unique_lock<mutex> lock(recycle_mtx);
     int id;
     if (!reusable_id.empty()) {
         id = reusable_id.front();
@@ -177,14 +379,606 @@ int ServiceServer<Request, Reply>::generate_stream_id() {
     return id;
 }
 template<typename Request, typename Reply>
-void ServiceServer<Request, Reply>::write_reply(const ServiceRPCReply& reply, const int& stream_id) {
+int ServiceServer<Request, Reply>::generate_call_id(const call_info& call) {
+    unique_lock<shared_mutex> lock(calls_status_mtx);
+    int id;
+    if (!reusable_call_id.empty()) {
+        id = reusable_call_id.front();
+        reusable_call_id.pop();
+        calls_[id] = call;
+        calls_status[id] = ServiceRPCReply::SUSPEND;
+        calls_token[id] = CancellationToken();
+    } else {
+        id = calls_.size();
+        calls_.push_back(call);
+        calls_token.push_back(CancellationToken());
+        calls_status.push_back(ServiceRPCReply::SUSPEND);
+    }
+    return id;
+}
+template<typename Request, typename Reply>
+void ServiceServer<Request, Reply>::recycle_stream(const int& stream_id) {
+    // never wait for user code on the completion queue thread, a busy stream is recycled by its last callback
+    vector<pair<int, call_info>> running;
+    {
+        unique_lock<mutex> lock(recycle_mtx);
+        for (auto &call: stream_calls[stream_id]) running.emplace_back(call.second, call_info{stream_id, call.first});
+    }
+    for (auto &call: running) if (!drop_queued(call.first, &call.second)) abort_call(call.first, &call.second);
+    unique_lock<mutex> lock(recycle_mtx);
+    if (!stream_calls[stream_id].empty()) closed[stream_id] = true;
+    else reusable_id.push(stream_id);
+}
+template<typename Request, typename Reply>
+void ServiceServer<Request, Reply>::finish_call(const int& call_id) {
+    call_info call;
+    {
+        unique_lock<shared_mutex> lock(calls_status_mtx);
+        call = calls_[call_id];
+        reusable_call_id.push(call_id);
+    }
+    unique_lock<mutex> lock(recycle_mtx);
+    if (call.stream_id < 0) {
+        auto it = local_calls.find(call.connection);
+        if (it == local_calls.end()) return;
+        it->second.erase(call.request_id);
+        if (it->second.empty()) local_calls.erase(it);
+        return;
+    }
+    stream_calls[call.stream_id].erase(call.request_id);
+    if (!closed[call.stream_id] || !stream_calls[call.stream_id].empty()) return;
+    closed[call.stream_id] = false;
+    reusable_id.push(call.stream_id);
+}
+template<typename Request, typename Reply>
+void ServiceServer<Request, Reply>::write_reply(const call_info& call, const ServiceCallStatus& status, const Reply* payload,
+const chrono::nanoseconds& queue_time, const chrono::nanoseconds& execute_time) {
+    const int64_t queue_us = chrono::duration_cast<chrono::microseconds>(queue_time).count();
+    const int64_t execute_us = chrono::duration_cast<chrono::microseconds>(execute_time).count();
+    if (call.stream_id < 0) {
+        // an empty length prefixed message for status only replies
+        if (local_) local_->write(call.connection, call.request_id, status, payload ? serialize(*payload) : string(4, '\0'), queue_us, execute_us);
+        return;
+    }
+    ServiceRPCReply reply;
+    reply.set_status(status);
+    reply.set_request_id(call.request_id);
+    reply.set_queue_us(queue_us);
+    reply.set_execute_us(execute_us);
+    if (payload) reply.mutable_payload()->PackFrom(*payload);
+    queue_reply(call.stream_id, move(reply));
+}
+template<typename Request, typename Reply>
+void ServiceServer<Request, Reply>::queue_reply(const int& stream_id, ServiceRPCReply reply) {
+    // grpc allows one outstanding write per stream, the others wait for its completion
     unique_lock<shared_mutex> lock(reply_wait_queue_mtx);
     if (contexts_[stream_id]->IsCancelled()) return;
-    if (reply_wait_queue[stream_id].empty()) {
+    if (!writing[stream_id]) {
+        writing[stream_id] = true;
         streams_[stream_id]->Write(reply, new ServerServiceType{stream_id, ServerServiceType::CompletionQueueType::WRITE});
-    } else {
-        reply_wait_queue[stream_id].push(reply);
+        return;
+    }
+    if (reply.status() == ServiceRPCReply::FEEDBACK) {
+        for (auto &waiting: reply_wait_queue[stream_id]) {
+            if (waiting.status() != ServiceRPCReply::FEEDBACK || waiting.request_id() != reply.request_id()) continue;
+            waiting.mutable_payload()->Swap(reply.mutable_payload());
+            return;
+        }
+    }
+    reply_wait_queue[stream_id].push_back(move(reply));
+}
+template<typename Request, typename Reply>
+template<typename Feedback>
+bool ServiceServer<Request, Reply>::publishFeedback(const int& call_id, const Feedback& feedback) {
+    call_info call;
+    {
+        shared_lock<shared_mutex> lock(calls_status_mtx);
+        if (calls_status[call_id] != ServiceRPCReply::PROCESS && calls_status[call_id] != ServiceRPCReply::PROMPTED) return false;
+        call = calls_[call_id];
+    }
+    if (call.stream_id < 0) {
+        if (local_) local_->write_feedback(call.connection, call.request_id, serialize(feedback));
+        return true;
+    }
+    ServiceRPCReply reply;
+    reply.set_status(ServiceRPCReply::FEEDBACK);
+    reply.set_request_id(call.request_id);
+    reply.mutable_payload()->PackFrom(feedback);
+    queue_reply(call.stream_id, move(reply));
+    return true;
+}
+template<typename Request, typename Reply>
+void ServiceServer<Request, Reply>::handle_request(const int& stream_id_) {
+    const ServiceRPCRequest& request = requests_[stream_id_];
+    const uint64_t request_id = request.request_id();
+    if (request.setting() == ServiceRPCRequest::SET_CANCELED) return cancel_call(call_info{stream_id_, request_id});
+    if (request.setting() != ServiceRPCRequest::PULL_NEW_REQ && request.setting() != ServiceRPCRequest::PULL_BATCH) {
+        LOG(WARNING) << "invalid operation, will not reponse to client";
+        return;
+    }
+    call_info call{stream_id_, request_id};
+    if (request.timeout_us() > 0) call.deadline = call.received + chrono::microseconds(request.timeout_us());
+    if (request.setting() == ServiceRPCRequest::PULL_NEW_REQ) {
+        // the packed bytes are the serialized request, a hit needs no parsing at all
+        const string& bytes = request.payload().value();
+        batch_item item;
+        if (accept_call(call, bytes.data(), bytes.size(), item)) run_call(item.call_id, item.call, move(item.request));
+        return;
+    }
+    vector<batch_item> items;
+    for (int i = 0; i < request.batch_size(); i++) {
+        call.request_id = request_id + i;
+        items.emplace_back();
+        if (!accept_call(call, request.batch(i).data(), request.batch(i).size(), items.back())) items.pop_back();
+    }
+    run_batch(move(items));
+}
+template<typename Request, typename Reply>
+void ServiceServer<Request, Reply>::handle_local_request(const uint64_t& connection, const uint64_t& request_id, const int32_t& setting, const int64_t& timeout_us, const char* msg, const int size) {
+    if (setting == ServiceRPCRequest::SET_CANCELED) return cancel_call(call_info{-1, request_id, connection});
+    if (setting != ServiceRPCRequest::PULL_NEW_REQ && setting != ServiceRPCRequest::PULL_BATCH) {
+        LOG(WARNING) << "invalid operation, will not reponse to client";
+        return;
+    }
+    call_info call{-1, request_id, connection};
+    if (timeout_us > 0) call.deadline = call.received + chrono::microseconds(timeout_us);
+    if (setting == ServiceRPCRequest::PULL_NEW_REQ) {
+        batch_item item;
+        if (accept_call(call, msg, size, item)) run_call(item.call_id, item.call, move(item.request));
+        return;
+    }
+    // a batch is the length prefixed messages of its requests back to back
+    vector<batch_item> items;
+    size_t offset = 0;
+    while (size_t item_size = read_message_size(msg + offset, size - offset)) {
+        if (offset + item_size > size) break;
+        items.emplace_back();
+        if (!accept_call(call, msg + offset + 4, item_size - 4, items.back())) items.pop_back();
+        offset += item_size;
+        call.request_id++;
+    }
+    run_batch(move(items));
+}
+template<typename Request, typename Reply>
+void ServiceServer<Request, Reply>::cancel_call(const call_info& call) {
+    int running_call = -1;
+    {
+        unique_lock<mutex> lock(recycle_mtx);
+        if (call.stream_id >= 0) {
+            auto it = stream_calls[call.stream_id].find(call.request_id);
+            if (it != stream_calls[call.stream_id].end()) running_call = it->second;
+        } else {
+            auto it = local_calls.find(call.connection);
+            if (it != local_calls.end() && it->second.count(call.request_id)) running_call = it->second[call.request_id];
+        }
+    }
+    if (running_call >= 0 && (setPrompted(running_call, &call) || drop_queued(running_call, &call))) return;
+    LOG(WARNING) << "cancel of request " << call.request_id << " which is not running, will not reponse to client";
+}
+template<typename Request, typename Reply>
+bool ServiceServer<Request, Reply>::accept_call(const call_info& call, const char* bytes, const size_t size, batch_item& item) {
+    // false when the call is answered from the cache, waits on an identical one, or is invalid
+    const string key = cache_enabled.load() ? string(bytes, size) : string();
+    if (reply_from_cache(key, call)) return false;
+    if (!item.request.ParseFromArray(bytes, size)) {
+        LOG(WARNING) << "invalid request " << call.request_id << ", will not reponse to client";
+        return false;
+    }
+    {
+        unique_lock<mutex> lock(recycle_mtx);
+        const bool running = call.stream_id >= 0 ? stream_calls[call.stream_id].count(call.request_id) > 0 :
+            local_calls.count(call.connection) && local_calls[call.connection].count(call.request_id);
+        if (running) {
+            LOG(WARNING) << "request " << call.request_id << " is already running, will not reponse to client";
+            return false;
+        }
+    }
+    item.call = call;
+    item.call_id = generate_call_id(call);
+    {
+        unique_lock<mutex> lock(recycle_mtx);
+        if (call.stream_id >= 0) stream_calls[call.stream_id][call.request_id] = item.call_id;
+        else local_calls[call.connection][call.request_id] = item.call_id;
+    }
+    return !collapse_call(key, item.call_id, call);
+}
+template<typename Request, typename Reply>
+void ServiceServer<Request, Reply>::close_local_connection(const uint64_t& connection) {
+    // the calls still run to their end, their replies are dropped
+    vector<pair<int, call_info>> running;
+    {
+        unique_lock<mutex> lock(recycle_mtx);
+        auto it = local_calls.find(connection);
+        if (it == local_calls.end()) return;
+        for (auto &call: it->second) running.emplace_back(call.second, call_info{-1, call.first, connection});
+    }
+    for (auto &call: running) if (!drop_queued(call.first, &call.second)) abort_call(call.first, &call.second);
+}
+template<typename Request, typename Reply>
+void ServiceServer<Request, Reply>::run_call(const int& call_id, const call_info& call, Request request_payload) {
+    {
+        unique_lock<mutex> lock(admission_mtx);
+        received++;
+        if (stopping) {
+            lock.unlock();
+            return reject_call(call_id, call, ServiceRPCReply::ABORTED);
+        }
+        if (call.deadline <= chrono::steady_clock::now()) {
+            lock.unlock();
+            return reject_call(call_id, call, ServiceRPCReply::DEADLINE_EXCEEDED);
+        }
+        if (max_concurrency > 0 && running >= max_concurrency) {
+            // expected wait: the calls ahead, and this one, each take the average time on one of the slots
+            const chrono::nanoseconds expected_wait = average_call_time * (queued.size() + 1) / max_concurrency;
+            if (queued.size() >= max_queue || expected_wait > queue_timeout) {
+                rejected++;
+                lock.unlock();
+                return reject_call(call_id, call, ServiceRPCReply::OVERLOADED);
+            }
+            queued.push_back(queued_call{call_id, call, move(request_payload), min(chrono::steady_clock::now() + queue_timeout, call.deadline)});
+            admission_cv.notify_one();
+            return;
+        }
+        running++;
+        active_tasks++;
+    }
+    start_call(call_id, call, move(request_payload));
+}
+template<typename Request, typename Reply>
+void ServiceServer<Request, Reply>::start_call(const int& call_id, const call_info& call, Request request_payload) {
+    setProcess(call_id);
+    const chrono::steady_clock::time_point started = chrono::steady_clock::now();
+    queue_latency.record(started - call.received);
+    if (async_cb_func) {
+        // request and reply live as long as the coroutine, which frees itself when done
+        auto payload = make_shared<pair<Request, Reply>>(move(request_payload), Reply());
+        auto start = [this, payload, call_id, call, started]() {
+            ServiceTask task = async_cb_func(&payload->first, &payload->second, this, call_id, token(call_id));
+            task.start([this, payload, call_id, call, started]() {
+                const ServiceCallStatus status = endStatus(call_id);
+                const chrono::nanoseconds execute_time = chrono::steady_clock::now() - started;
+                execute_latency.record(execute_time);
+                write_reply(call, status, &payload->second, started - call.received, execute_time);
+                complete_cached(call_id, status, &payload->second);
+                finish_call(call_id);
+                release_call(started);
+                leave_task();
+            });
+        };
+        if (!dispatch(move(start))) refuse_started({call_id}, {call});
+        return;
+    }
+    auto run = [this, request_payload = move(request_payload), call_id, call, started]() {
+        Reply reply_payload;
+        cb_func(&request_payload, &reply_payload, this, call_id);
+        const ServiceCallStatus status = endStatus(call_id);
+        const chrono::nanoseconds execute_time = chrono::steady_clock::now() - started;
+        execute_latency.record(execute_time);
+        write_reply(call, status, &reply_payload, started - call.received, execute_time);
+        complete_cached(call_id, status, &reply_payload);
+        finish_call(call_id);
+        release_call(started);
+        leave_task();
+    };
+    if (!dispatch(move(run))) refuse_started({call_id}, {call});
+}
+template<typename Request, typename Reply>
+void ServiceServer<Request, Reply>::setBatchHandler(BatchFunctionType cb) {
+    batch_cb_func = cb;
+}
+template<typename Request, typename Reply>
+void ServiceServer<Request, Reply>::run_batch(vector<batch_item> items) {
+    const BatchFunctionType batch_cb = batch_cb_func.load();
+    const size_t batch_size = items.size();
+    if (!batch_cb) {
+        for (auto &item: items) run_call(item.call_id, item.call, move(item.request));
+        return;
+    }
+    const chrono::steady_clock::time_point now = chrono::steady_clock::now();
+    for (auto it = items.begin(); it != items.end();) {
+        if (it->call.deadline > now) {
+            it++;
+            continue;
+        }
+        reject_call(it->call_id, it->call, ServiceRPCReply::DEADLINE_EXCEEDED);
+        it = items.erase(it);
+    }
+    if (items.empty()) return;
+    {
+        unique_lock<mutex> lock(admission_mtx);
+        received += batch_size;
+        if (stopping || (max_concurrency > 0 && running >= max_concurrency)) {
+            const ServiceCallStatus status = stopping ? ServiceRPCReply::ABORTED : ServiceRPCReply::OVERLOADED;
+            if (!stopping) rejected += items.size();
+            lock.unlock();
+            for (auto &item: items) reject_call(item.call_id, item.call, status);
+            return;
+        }
+        running++;
+        active_tasks++;
+    }
+    const chrono::steady_clock::time_point started = chrono::steady_clock::now();
+    vector<int> call_ids;
+    vector<call_info> calls;
+    for (auto &item: items) {
+        setProcess(item.call_id);
+        queue_latency.record(started - item.call.received);
+        call_ids.push_back(item.call_id);
+        calls.push_back(item.call);
+    }
+    auto run = [this, items = move(items), batch_cb, started]() mutable {
+        vector<Request> requests;
+        vector<Reply> replies(items.size());
+        vector<int> call_ids;
+        requests.reserve(items.size());
+        call_ids.reserve(items.size());
+        for (auto &item: items) {
+            requests.push_back(move(item.request));
+            call_ids.push_back(item.call_id);
+        }
+        batch_cb(requests, replies, this, call_ids);
+        const chrono::nanoseconds execute_time = chrono::steady_clock::now() - started;
+        for (size_t i = 0; i < items.size(); i++) {
+            const ServiceCallStatus status = endStatus(items[i].call_id);
+            execute_latency.record(execute_time);
+            write_reply(items[i].call, status, &replies[i], started - items[i].call.received, execute_time);
+            complete_cached(items[i].call_id, status, &replies[i]);
+            finish_call(items[i].call_id);
+        }
+        release_call(started);
+        leave_task();
+    };
+    if (!dispatch(move(run))) refuse_started(call_ids, calls);
+}
+template<typename Request, typename Reply>
+bool ServiceServer<Request, Reply>::dispatch(function<void()> task) {
+    if (pool_) return pool_->post(move(task));
+    task();
+    return true;
+}
+template<typename Request, typename Reply>
+void ServiceServer<Request, Reply>::refuse_started(const vector<int>& call_ids, const vector<call_info>& calls) {
+    // the workers are backed up, give the slot back and reject instead of growing their queue
+    {
+        unique_lock<mutex> lock(admission_mtx);
+        running--;
+        rejected += call_ids.size();
+    }
+    for (size_t i = 0; i < call_ids.size(); i++) reject_call(call_ids[i], calls[i], ServiceRPCReply::OVERLOADED);
+    leave_task();
+}
+template<typename Request, typename Reply>
+void ServiceServer<Request, Reply>::leave_task() {
+    // notified under the lock, the destructor may free the server as soon as it is released
+    unique_lock<mutex> lock(admission_mtx);
+    active_tasks--;
+    tasks_cv.notify_all();
+}
+template<typename Request, typename Reply>
+void ServiceServer<Request, Reply>::release_call(const chrono::steady_clock::time_point& started) {
+    // the freed slot goes to the oldest queued call that can still meet its deadline
+    vector<queued_call> expired;
+    deque<queued_call> next;
+    {
+        unique_lock<mutex> lock(admission_mtx);
+        const chrono::steady_clock::time_point now = chrono::steady_clock::now();
+        average_call_time = average_call_time.count() == 0 ? chrono::nanoseconds(now - started) :
+            (average_call_time * 7 + chrono::nanoseconds(now - started)) / 8;
+        running--;
+        while (!stopping && !queued.empty()) {
+            queued_call front = move(queued.front());
+            queued.pop_front();
+            if (front.deadline < now) {
+                if (front.deadline != front.call.deadline) rejected++;
+                expired.push_back(move(front));
+                continue;
+            }
+            running++;
+            active_tasks++;
+            next.push_back(move(front));
+            break;
+        }
+    }
+    for (auto &call: expired) reject_call(call.call_id, call.call, expired_status(call));
+    for (auto &call: next) start_call(call.call_id, call.call, move(call.request));
+}
+template<typename Request, typename Reply>
+ServiceCallStatus ServiceServer<Request, Reply>::expired_status(const queued_call& call) {
+    // the queue deadline is the earlier of the queue timeout and the deadline of the call
+    return call.deadline == call.call.deadline ? ServiceRPCReply::DEADLINE_EXCEEDED : ServiceRPCReply::OVERLOADED;
+}
+template<typename Request, typename Reply>
+void ServiceServer<Request, Reply>::reject_call(const int& call_id, const call_info& call, const ServiceCallStatus& status) {
+    {
+        unique_lock<shared_mutex> lock(calls_status_mtx);
+        calls_status[call_id] = status;
+    }
+    write_reply(call, status);
+    complete_cached(call_id, status, nullptr);
+    finish_call(call_id);
+}
+template<typename Request, typename Reply>
+bool ServiceServer<Request, Reply>::drop_queued(const int& call_id, const call_info* expected) {
+    // a queued or collapsed call canceled by its client, or whose client went away, never starts
+    call_info call;
+    bool found = false;
+    {
+        unique_lock<mutex> lock(admission_mtx);
+        auto it = find_if(queued.begin(), queued.end(), [&](const queued_call& queued_) {
+            return queued_.call_id == call_id && (!expected || same_call(queued_.call, *expected));
+        });
+        if (it != queued.end()) {
+            call = it->call;
+            queued.erase(it);
+            found = true;
+        }
+    }
+    if (!found) {
+        unique_lock<mutex> lock(cache_mtx);
+        for (auto &waiting: inflight) {
+            auto it = find_if(waiting.second.begin(), waiting.second.end(), [&](const pair<int, call_info>& waiter) {
+                return waiter.first == call_id && (!expected || same_call(waiter.second, *expected));
+            });
+            if (it == waiting.second.end()) continue;
+            call = it->second;
+            waiting.second.erase(it);
+            found = true;
+            break;
+        }
+    }
+    if (!found) return false;
+    reject_call(call_id, call, ServiceRPCReply::ABORTED);
+    return true;
+}
+template<typename Request, typename Reply>
+bool ServiceServer<Request, Reply>::reply_from_cache(const string& key, const call_info& call) {
+    if (!cache_enabled.load()) return false;
+    shared_ptr<const Reply> reply;
+    {
+        unique_lock<mutex> lock(cache_mtx);
+        auto it = cache_.find(key);
+        if (it == cache_.end()) return false;
+        if (it->second.expires < chrono::steady_clock::now()) {
+            cache_lru.erase(it->second.lru_pos);
+            cache_.erase(it);
+            return false;
+        }
+        cache_lru.splice(cache_lru.begin(), cache_lru, it->second.lru_pos);
+        reply = it->second.reply;
+        cache_hits++;
+    }
+    write_reply(call, ServiceRPCReply::SUCCESS, reply.get());
+    return true;
+}
+template<typename Request, typename Reply>
+bool ServiceServer<Request, Reply>::collapse_call(const string& key, const int& call_id, const call_info& call) {
+    if (!cache_enabled.load()) return false;
+    unique_lock<mutex> lock(cache_mtx);
+    auto it = inflight.find(key);
+    if (it != inflight.end()) {
+        it->second.emplace_back(call_id, call);
+        collapsed++;
+        return true;
     }
+    inflight[key];
+    inflight_keys[call_id] = make_pair(key, cache_generation);
+    return false;
+}
+template<typename Request, typename Reply>
+void ServiceServer<Request, Reply>::complete_cached(const int& call_id, const ServiceCallStatus& status, const Reply* payload) {
+    vector<pair<int, call_info>> waiters;
+    {
+        unique_lock<mutex> lock(cache_mtx);
+        auto key_it = inflight_keys.find(call_id);
+        if (key_it == inflight_keys.end()) return;
+        const string key = move(key_it->second.first);
+        const bool current = key_it->second.second == cache_generation;
+        inflight_keys.erase(key_it);
+        auto it = inflight.find(key);
+        if (it != inflight.end()) {
+            waiters = move(it->second);
+            inflight.erase(it);
+        }
+        if (status == ServiceRPCReply::SUCCESS && payload && current && cache_max_entries > 0) {
+            auto cached = cache_.find(key);
+            if (cached != cache_.end()) {
+                cache_lru.erase(cached->second.lru_pos);
+                cache_.erase(cached);
+            }
+            cache_lru.push_front(key);
+            cache_[key] = cache_entry{make_shared<const Reply>(*payload), chrono::steady_clock::now() + cache_ttl, cache_lru.begin()};
+            while (cache_.size() > cache_max_entries) {
+                cache_.erase(cache_lru.back());
+                cache_lru.pop_back();
+            }
+        }
+    }
+    for (auto &waiter: waiters) {
+        {
+            unique_lock<shared_mutex> lock(calls_status_mtx);
+            calls_status[waiter.first] = status;
+        }
+        write_reply(waiter.second, status, payload);
+        finish_call(waiter.first);
+    }
+}
+template<typename Request, typename Reply>
+void ServiceServer<Request, Reply>::setCache(const size_t& max_entries, const chrono::milliseconds& ttl) {
+    unique_lock<mutex> lock(cache_mtx);
+    cache_max_entries = max_entries;
+    cache_ttl = ttl;
+    while (cache_.size() > cache_max_entries) {
+        cache_.erase(cache_lru.back());
+        cache_lru.pop_back();
+    }
+    // running calls that collapsed others still hand their reply over when disabled
+    cache_enabled = max_entries > 0;
+}
+template<typename Request, typename Reply>
+void ServiceServer<Request, Reply>::invalidateCache() {
+    unique_lock<mutex> lock(cache_mtx);
+    cache_generation++;
+    cache_.clear();
+    cache_lru.clear();
+}
+template<typename Request, typename Reply>
+void ServiceServer<Request, Reply>::invalidateCache(const Request& request) {
+    const string key = request.SerializeAsString();
+    unique_lock<mutex> lock(cache_mtx);
+    cache_generation++;
+    auto it = cache_.find(key);
+    if (it == cache_.end()) return;
+    cache_lru.erase(it->second.lru_pos);
+    cache_.erase(it);
+}
+template<typename Request, typename Reply>
+void ServiceServer<Request, Reply>::expire_queued() {
+    while (core::ok()) {
+        vector<queued_call> expired;
+        {
+            unique_lock<mutex> lock(admission_mtx);
+            chrono::steady_clock::time_point wake = chrono::steady_clock::now() + chrono::milliseconds(100);
+            for (auto &call: queued) wake = min(wake, call.deadline);
+            admission_cv.wait_until(lock, wake, [this]() {return stopping;});
+            if (stopping) return;
+            const chrono::steady_clock::time_point now = chrono::steady_clock::now();
+            for (auto it = queued.begin(); it != queued.end();) {
+                if (it->deadline >= now) {
+                    it++;
+                    continue;
+                }
+                if (it->deadline != it->call.deadline) rejected++;
+                expired.push_back(move(*it));
+                it = queued.erase(it);
+            }
+        }
+        for (auto &call: expired) reject_call(call.call_id, call.call, expired_status(call));
+    }
+}
+template<typename Request, typename Reply>
+void ServiceServer<Request, Reply>::setAdmission(const int& max_concurrency_, const int& max_queue_, const chrono::milliseconds& queue_timeout_) {
+    unique_lock<mutex> lock(admission_mtx);
+    max_concurrency = max_concurrency_;
+    max_queue = max_queue_;
+    queue_timeout = queue_timeout_;
+    if (max_concurrency > 0 && !admission_thread.joinable()) admission_thread = thread(&ServiceServer<Request, Reply>::expire_queued, this);
+}
+template<typename Request, typename Reply>
+ServiceServerStats ServiceServer<Request, Reply>::stats() {
+    ServiceServerStats stats_;
+    {
+        unique_lock<mutex> cache_lock(cache_mtx);
+        stats_.cache_hits = cache_hits;
+        stats_.collapsed = collapsed;
+    }
+    unique_lock<mutex> lock(admission_mtx);
+    stats_.running = running;
+    stats_.queue_depth = queued.size();
+    // calls answered from the cache or by an identical call never reach the admission control
+    stats_.received = received + stats_.cache_hits + stats_.collapsed;
+    stats_.rejected = rejected;
+    stats_.reject_rate = stats_.received ? static_cast<double>(rejected) / stats_.received : 0;
+    return stats_;
 }
 template<typename Request, typename Reply>
 void ServiceServer<Request, Reply>::handle_event(const ServerServiceType* tag) {
@@ -193,33 +987,12 @@ void ServiceServer<Request, Reply>::handle_event(const ServerServiceType* tag) {
     case ServerServiceType::CompletionQueueType::CONNECT:{
         int id = generate_stream_id();
         CreateListenPort(id);
-        setSuspend(tag->stream_id);
         streams_[tag->stream_id]->Read(&requests_[tag->stream_id], new ServerServiceType{tag->stream_id, ServerServiceType::CompletionQueueType::READ});
         break;
     }
     case ServerServiceType::CompletionQueueType::READ:{
-        Request request_payload;
-        int stream_id_ = tag->stream_id;
-        if (isSuspend(stream_id_) 
-        && requests_[stream_id_].setting() == ServiceRPCRequest::PULL_NEW_REQ) {
-            requests_[stream_id_].payload().UnpackTo(&request_payload);
-            setProcess(stream_id_);
-            future_storages[stream_id_] = async(launch::async, [this, request_payload, stream_id_]() {
-                Reply reply_payload;
-                cb_func(&request_payload, &reply_payload, this, stream_id_);
-                ServiceRPCReply reply;
-                reply.set_status(endStatus(stream_id_));
-                reply.mutable_payload()->PackFrom(reply_payload);
-                write_reply(reply, stream_id_);
-                setSuspend(stream_id_);
-            });
-        } else if (isProcess(stream_id_) 
-        && requests_[stream_id_].setting() == ServiceRPCRequest::SET_CANCELED) {
-            setPrompted(stream_id_);
-        } else {
-            LOG(WARNING) << "invalid operation, will not reponse to client";
-        }
-        streams_[stream_id_]->Read(&requests_[stream_id_], new ServerServiceType{stream_id_, ServerServiceType::CompletionQueueType::READ});
+        handle_request(tag->stream_id);
+        streams_[tag->stream_id]->Read(&requests_[tag->stream_id], new ServerServiceType{tag->stream_id, ServerServiceType::CompletionQueueType::READ});
         break;
     }
     case ServerServiceType::CompletionQueueType::WRITE: {
@@ -227,12 +1000,14 @@ void ServiceServer<Request, Reply>::handle_event(const ServerServiceType* tag) {
         if (!reply_wait_queue[tag->stream_id].empty()) {
             auto reply = reply_wait_queue[tag->stream_id].front();
             streams_[tag->stream_id]->Write(reply, new ServerServiceType{tag->stream_id, ServerServiceType::CompletionQueueType::WRITE});
-            reply_wait_queue[tag->stream_id].pop();
+            reply_wait_queue[tag->stream_id].pop_front();
+        } else {
+            writing[tag->stream_id] = false;
         }
         break;
     }
     case ServerServiceType::CompletionQueueType::BROKEN_PIPE: {
-        reusable_id.push(tag->stream_id);
+        recycle_stream(tag->stream_id);
         LOG(INFO) << "Client stream " << tag->stream_id << " closed";
         break;
     }
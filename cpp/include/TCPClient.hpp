@@ -9,31 +9,160 @@
 #include <vector>
 #include <unordered_map>
 #include <unordered_set>
+#include <map>
+#include <future>
+#include <memory>
+#include <atomic>
 #include <cstdio>
+#include <functional>
 #include "AsyncSocket.hpp"
+#include "MPSCQueue.hpp"
 
 #define MAX_WRITE_BUFFER_SIZE                           65536
+#define LARGE_MESSAGE_THRESHOLD                         262144  // default payload size sent with MSG_ZEROCOPY
+#define LARGE_MESSAGE_CHUNK_SIZE                        1048576 // large payloads are framed and written in chunks of this size
 
 namespace core{
 using namespace std;
 class NodeHandler;
 class client_info;
+class TCPClient;
+
+/*
+A session is one outgoing tcp connection to a subscriber. A dedicated session carries a single topic
+as a raw byte stream, a multiplexed session carries many topics as channels of framed data.
+Publishers only touch the inbox, everything else is owned by the io thread or guarded by TCPClient::mtx.
+*/
+struct session_info {
+    struct outgoing {
+        uint32_t                                        channel = 0;
+        shared_ptr<const string>                        payload;
+        bool                                            open = false;
+    };
+    struct frame {
+        string                                          header;
+        shared_ptr<const string>                        payload;
+        size_t                                          begin = 0;  // a chunk is a slice of the payload
+        size_t                                          length = 0;
+        size_t                                          offset = 0; // bytes already written
+        bool                                            zerocopy = false;
+        size_t                                          size() const {return header.size() + length;}
+    };
+    int                                                 fd = -1;
+    bool                                                multiplex = false;
+    bool                                                high_priority = false;
+    atomic<bool>                                        connected {false};
+    atomic<bool>                                        closing {false};
+    atomic<bool>                                        scheduled {false};
+    MPSCQueue<outgoing>                                 inbox;
+
+    // guarded by TCPClient::mtx
+    string                                              key;
+    string                                              local_ip;
+    int                                                 local_port = 0;
+    shared_future<bool>                                 ready;
+    unordered_map<string, uint32_t>                     channels;       // topic, channel id
+    uint32_t                                            next_channel = 1;
+
+    // owned by the io thread
+    map<uint32_t, deque<frame>>                         pending;        // channel, frames wait to write
+    map<uint32_t, size_t>                               pending_bytes;
+    int64_t                                             head_channel = -1; // channel of a partially written frame
+    size_t                                              round_robin = 0;
+    bool                                                zerocopy = false;
+    uint32_t                                            zerocopy_seq = 0;
+    deque<pair<uint32_t, shared_ptr<const string>>>     zerocopy_inflight; // payloads pinned by the kernel until completion
+};
+
+/*
+Routes of a topic are published as immutable snapshots. Readers only bump the counter of the current phase,
+so publishing never waits. The control path flips the phase on each swap and frees the replaced snapshot once
+the readers of the old phase have left, no retired snapshot outlives its update.
+*/
+class topic_writer {
+    public:
+    struct route {
+        shared_ptr<session_info>                        session;
+        uint32_t                                        channel;
+    };
+    using route_list = vector<route>;
+    topic_writer() : routes(new route_list()) {}
+    ~topic_writer();
+    bool                                                has_subscribers() const;
+    private:
+    struct read_guard {
+        read_guard(const topic_writer& writer_) : writer(writer_) {
+            // counted in a phase that was still current after the count, else update may miss it
+            while (true) {
+                phase = writer.phase.load();
+                writer.readers[phase].fetch_add(1);
+                if (writer.phase.load() == phase) break;
+                writer.readers[phase].fetch_sub(1);
+            }
+            list = writer.routes.load();
+        }
+        ~read_guard()                                   {writer.readers[phase].fetch_sub(1);}
+        const topic_writer&                             writer;
+        int                                             phase;
+        const route_list*                               list;
+    };
+    atomic<const route_list*>                           routes;
+    atomic<int>                                         phase {0};
+    mutable atomic<int>                                 readers[2] = {0, 0};
+    bool                                                high_priority = false;
+    void                                                update(const route_list* next);    // called under TCPClient::mtx, waits out the readers of the old snapshot
+    friend class                                        TCPClient;
+};
+
 class TCPClient final: public Socket {
     public:
-    TCPClient();
-    client_info                                         add_client(const string& topic, const string& ip, const int& port);
-    void                                                write_to_socket(const string& topic, const string& msg, const int& timeout = 0);
+    TCPClient(const size_t zerocopy_threshold_ = LARGE_MESSAGE_THRESHOLD); // 0 disables MSG_ZEROCOPY
+    ~TCPClient();
+    client_info                                         add_client(const string& topic, const string& ip, const int& port, bool multiplex = false, bool high_priority = false);
+    shared_ptr<topic_writer>                            get_writer(const string& topic);
+    void                                                write_to_socket(const shared_ptr<topic_writer>& writer, string msg);
     bool                                                write_to_cache(const string& topic, const string& data);
+    int                                                 subscriber_count(const string& topic);
+    void                                                add_subscribe_callback(const string& topic, function<void(const int)> cb);
+    void                                                add_unsubscribe_callback(const string& topic, function<void(const int)> cb);
+    void                                                set_high_priority_topic(const string& topic);
     private:
-    unordered_map<string, unordered_set<int>>           clients_topic_fd;
-    vector<string>                                      clients_data;
+    shared_mutex                                        mtx;
+    unordered_map<string, shared_ptr<topic_writer>>     writers;
+    unordered_map<string, shared_ptr<session_info>>     sessions;       // multiplexed sessions by subscriber tcp server address and lane
+    unordered_map<int, shared_ptr<session_info>>        fd_sessions;
+    unordered_map<string, unordered_set<string>>        static_topic_cache;
+    unordered_map<string, vector<function<void(const int)>>> subscribe_callbacks;
+    unordered_map<string, vector<function<void(const int)>>> unsubscribe_callbacks;
+
+    MPSCQueue<shared_ptr<session_info>>                 ready_high_priority;
+    MPSCQueue<shared_ptr<session_info>>                 ready_normal_priority;
+    int                                                 wake_fd[2];     // linux uses an eventfd in wake_fd[0]
+    atomic<bool>                                        running;
+    const size_t                                        zerocopy_threshold;
+    thread                                              io_thread;
+
     void                                                close_and_delete_event(const int& fd);
-    bool                                                get_socket_info(const int& fd, string& src_ip, int& src_port);   
-    bool                                                write_fd(const string& topic, const int& fd);
-    shared_mutex                                        mtx;             
-    unordered_map<string, unordered_set<string>>        static_topic_cache;         
-}; 
-} 
+    bool                                                get_socket_info(const int& fd, string& src_ip, int& src_port);
+    bool                                                is_peer_closed(const int& fd);
+    void                                                notify_subscription(const string& topic, bool subscribed);
+
+    shared_ptr<topic_writer>                            writer_of(const string& topic);
+    bool                                                connect_session(shared_ptr<session_info> session, const string& ip, const int& port);
+    void                                                open_channel(shared_ptr<session_info> session, const string& topic);
+    bool                                                add_route(const string& topic, shared_ptr<session_info> session, const uint32_t channel);
+    vector<string>                                      drop_session(shared_ptr<session_info> session);
+
+    void                                                schedule(const shared_ptr<session_info>& session);
+    void                                                wake();
+    void                                                io_loop();
+    void                                                flush(const shared_ptr<session_info>& session);
+    void                                                stage(session_info& session, session_info::outgoing item);
+    bool                                                write_session(session_info& session);
+    ssize_t                                             send_zerocopy(session_info& session, const struct iovec& iov, const shared_ptr<const string>& payload);
+    void                                                reap_zerocopy(session_info& session);
+};
+}
 
 
-#endif
\ No newline at end of file
+#endif
@@ -9,6 +9,7 @@
 #include <vector>
 #include <map>
 #include <set>
+#include <unordered_set>
 #include <cstdio>
 #include "serialization.hpp"
 #include "AsyncSocket.hpp"
@@ -19,7 +20,7 @@ class TCPServer final: public Socket {
     public:
     TCPServer(const string& ip, const int port = 0);
     int                                     init_tcp_srv(); 
-    void                                    accept_client(const string& topic, const string& ip, const int &port);
+    void                                    accept_client(const string& topic, const string& ip, const int &port, bool multiplex = false, bool high_priority = false);
     int                                     event_handler(int timeout = 0); // do all event in event pool
     unordered_map<string, Decoder*>         decoders;
     private:
@@ -27,12 +28,20 @@ class TCPServer final: public Socket {
     vector<string>                          fd_to_addr;
     vector<string>                          fd_receive_data;
     unordered_map<string, int>              unmapped_addr_to_fd;
+    unordered_set<string>                   session_addrs;
+    unordered_set<int>                      high_priority_fds;
+    unordered_map<int, unordered_map<uint32_t, string>> session_channels; // fd, channel id, topic
+    unordered_map<int, unordered_map<uint32_t, string>> session_messages; // fd, channel id, chunks of a large message received so far
     void                                    handle_client_event(const int& client_fd, const int& revents); 
+    void                                    decode_session(const int& client_fd);
+    ssize_t                                 receive(const int& client_fd, const bool is_session, char* buffer, const size_t size);
     int                                     accept_new_client();
     int                                     tcp_srv_fd;
     const string                            tcp_srv_ip;
     int                                     tcp_srv_port;
     const int                               max_buffer_size = 65536;
+    const int                               max_large_read_size = 262144;
+    const int                               max_idle_buffer_size = 16777216; // larger receive buffers are released after use
 
     int                                     bind_socket(const int& fd, const sockaddr_in& addr);
     int                                     listen_socket(const int& fd);
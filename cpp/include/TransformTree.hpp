@@ -10,25 +10,40 @@ namespace core {
 
 using namespace std;
 
+/*
+History of one frame, a ring of samples in time order. Samples older than memory_duration behind the
+newest one, or beyond the capacity, are dropped from the front. A sample older than the newest is
+inserted in place, it is rare and usually near the end.
+A lookup between two samples at most 2 * tolerance_ms apart interpolates them, position linearly and
+rotation by slerp, so it succeeds exactly when the nearest sample is within tolerance_ms. Between samples
+further apart it takes the nearest one if that is within tolerance_ms. Out of the history it extrapolates
+the two samples at that end up to extrapolation_ms away, else takes the end sample if it is within tolerance_ms.
+*/
 class TransformTreeNode {
     public:
-    TransformTreeNode(const string& id, const int memory_duration_ms = 1000);
+    static const int                    DEFAULT_HISTORY = 512;  // 2.5 s at 200 Hz
+    TransformTreeNode(const string& id, const int memory_duration_ms = 1000, const int capacity = DEFAULT_HISTORY);
     TransformTreeNode*                  parent;
-    bool                                transform(KDL::Frame& frame, const google::protobuf::Timestamp least_stamp, int tolerance_ms);
-    void                                push(const std_msgs::TransformD transform);
+    bool                                transform(KDL::Frame& frame, const google::protobuf::Timestamp least_stamp, int tolerance_ms, int extrapolation_ms = 0);
+    void                                push(const std_msgs::TransformD& transform);
     const string                        frame_id;
     bool                                is_static = false;
     private:
 
-    struct TransformEntry {
-        std_msgs::TransformD            transform;
-        bool                            operator<(const TransformEntry& other) const ;
+    struct TransformSample {
+        int64_t                         stamp;  // ns
+        double                          p[3];
+        double                          q[4];   // x, y, z, w
         KDL::Frame                      toKDL() const;
+        static TransformSample          interpolate(const TransformSample& a, const TransformSample& b, const int64_t& stamp);
     };
 
-    set<TransformEntry>                 value_time_series;
-    const int                           memory_duration;
-    void                                cleanup(google::protobuf::Timestamp current_time);
+    vector<TransformSample>             samples;
+    size_t                              head = 0;   // oldest sample
+    size_t                              count = 0;
+    const int64_t                       memory_duration;    // ns
+    TransformSample&                    at(const size_t& i) {return samples[(head + i) % samples.size()];}
+    size_t                              lower_bound(const int64_t& stamp);  // first sample not before stamp
 };
 
 class TransformTree {
@@ -37,8 +52,11 @@ class TransformTree {
     void                                addTransformNode(const std_msgs::TransformD node, bool is_static = false);
     bool                                transform(KDL::Frame& frame, const string from, const string to, const google::protobuf::Timestamp least_stamp, int tolerance_ms = -1);
     // case 1: no tolerance set (-1), would get the latest timestamp
-    // case 2: tolerance set, would get the timestamp whom been in tolerance
+    // case 2: tolerance set, would interpolate the samples around the timestamp if they are at most 2 * tolerance apart,
+    //         or get the nearest one in tolerance
+    void                                setMaxExtrapolation(const int extrapolation_ms) {max_extrapolation = extrapolation_ms;}
     private:
+    int                                 max_extrapolation = 0;  // ms past the history a lookup may extrapolate
     map<string, TransformTreeNode*>     nodes;
     bool                                valid;
     map<string, TransformTreeNode*>     shared_ancestor;
@@ -69,6 +87,7 @@ class TransformListener {
     using tf_publisher = shared_ptr<Publisher<std_msgs::TransformD>>;
     TransformListener(shared_ptr<NodeHandler> nh, tf_publisher pub);
     bool                                lookupTransform(const string& from_tf, const string& to_tf, std_msgs::TransformD &transform, const int timeout_ms = -1);
+    void                                setMaxExtrapolation(const int extrapolation_ms) {tf_tree.setMaxExtrapolation(extrapolation_ms);}
     // bool                                waitForTransform(const string& from_tf, const string& to_tf, TransformD &transform, const int timeout_ms = -1);
     private:
     TransformTree                       tf_tree;
@@ -0,0 +1,39 @@
+#ifndef WORKER_POOL_HPP
+#define WORKER_POOL_HPP
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <functional>
+#include <deque>
+#include <vector>
+#include <glog/logging.h>
+
+#define DEFAULT_SERVICE_WORKERS                         8
+#define DEFAULT_SERVICE_QUEUE                           1024
+
+namespace core {
+using namespace std;
+/*
+A fixed set of threads running posted tasks in order of arrival.
+Tasks posted while every worker is busy wait in the queue instead of starting a new thread, a full queue refuses them.
+*/
+class WorkerPool final {
+    public:
+    WorkerPool(const int& workers, const size_t& max_queue = 0); // 0 never refuses
+    ~WorkerPool();
+    WorkerPool(const WorkerPool&)                       = delete;
+    WorkerPool& operator=(const WorkerPool&)            = delete;
+    bool                                                post(function<void()> task);
+    int                                                 size() const;
+    private:
+    mutex                                               mtx;
+    condition_variable                                  cv;
+    deque<function<void()>>                             tasks;
+    vector<thread>                                      threads;
+    const size_t                                        max_queue;
+    bool                                                stopping = false;
+    void                                                run();
+};
+}
+
+#endif
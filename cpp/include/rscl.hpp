@@ -28,6 +28,8 @@ namespace core {
         public:
         string                              ip = "";
         int                                 port = 0;
+        int                                 channel = 0;
+        bool                                high_priority = false;
         future<bool>                        connected;
     };
     class NodeHandler: public enable_shared_from_this<NodeHandler> {
@@ -35,25 +37,27 @@ namespace core {
         NodeHandler(const string& name_, const string& namespace_);
         void                                    Init();
         template<class msg_t>
-        Subscriber                              subscribe(const string& topic, void (*cb)(const msg_t*));
+        Subscriber                              subscribe(const string& topic, void (*cb)(const msg_t*), TopicPriority priority = NORMAL_PRIORITY);
         template<class msg_t>
-        Subscriber                              subscribe(const string& topic, function<void(const msg_t*)> cb);
+        Subscriber                              subscribe(const string& topic, function<void(const msg_t*)> cb, TopicPriority priority = NORMAL_PRIORITY);
         template<class msg_t>
-        Publisher<msg_t>                        advertise(const string& topic);
+        Publisher<msg_t>                        advertise(const string& topic, TopicPriority priority = NORMAL_PRIORITY);
         void                                    spinOnce();
         template<typename Request, typename Reply>
         ServiceClient<Request, Reply>           serviceClient(const string& service);
         template<typename Request, typename Reply>
-        ServiceServer<Request, Reply>           serviceServer(const string& service, void(*)(const Request*, Reply*, ServiceServer<Request, Reply>*, const int&));
+        ServiceServer<Request, Reply>           serviceServer(const string& service, void(*)(const Request*, Reply*, ServiceServer<Request, Reply>*, const int&), bool inline_callback = false);
+        template<typename Request, typename Reply>
+        ServiceServer<Request, Reply>           serviceServer(const string& service, ServiceTask(*)(const Request*, Reply*, ServiceServer<Request, Reply>*, const int, CancellationToken), bool inline_callback = false);
 
         TransformBroadcaster                    tfBroadcaster();
         StaticTransformBroadcaster              tfStaticBroadcaster();
         TransformListener                       tfListener();
 
         template<typename param_t>
-        void                                    setParameter(const string& name, const param_t val);
+        bool                                    setParameter(const string& name, const param_t val);
         template<typename param_t>
-        void                                    declareParameter(const string& name, const param_t val, bool is_const = false);
+        ParamHandle<param_t>                    declareParameter(const string& name, const param_t val, bool is_const = false);
         template<typename param_t>
         bool                                    getParameter(const string& name, param_t &val);
         template<typename param_t>
@@ -63,36 +67,54 @@ namespace core {
         ParameterStatus                         setRemoteParameter(const string& name, const param_t val, const string& namespace_);
         template<typename param_t>
         ParameterStatus                         getRemoteParameter(const string& name, param_t &val, const string& namespace_);
+        // waits up to timeout for the first value, later calls read the local copy, val is kept while *version is current
+        template<typename param_t>
+        ParameterStatus                         getRemoteParameter(const string& name, param_t &val, const string& namespace_,
+                                                const chrono::nanoseconds& timeout, int64_t* version = nullptr);
         template<typename param_t>
         ParameterStatus                         getRemoteDynamicParameter(const string& name, void(*)(const param_t), const string& namespace_);
+        void                                    unwatchRemoteParameter(const string& name, const string& namespace_);   // stop the updates of a remote parameter
+        ParameterStatus                         batchRemoteParameters(const ParamBatch& batch, ParamBatchResult& result, const string& namespace_);
+        bool                                    saveParameters(const string& path);
+        bool                                    loadParameters(const string& path);    // may be called before Init
 
 
         private:
         void                                    regist_node(const string& node, const string& ip, const int& port);
         template<class msg_t>
-        Subscriber                              subscribe_impl(const string& topic, function<void(const msg_t*)> cb);
+        Subscriber                              subscribe_impl(const string& topic, function<void(const msg_t*)> cb, TopicPriority priority);
         void                                    delete_node(const string& node);
         const string                            this_node_name();
 
         bool                                    find_wait_published_topic(const string& topic, const string& url);
         void                                    add_published_topic(const string& topic, const string& url);
         void                                    add_subscribed_topic(const string& topic, const string& url);
-        client_info                             add_tcp_client(const string& node, const string& topic, const string& ip, const int& port);
+        client_info                             add_tcp_client(const string& node, const string& topic, const string& ip, const int& port, bool multiplex = false, bool high_priority = false);
 
-        bool                                    find_wait_served_service(const string& service);
         bool                                    find_serving_service(const string& service);
-        future<string>                          add_served_service(const string& service);
-        future<string>                          reset_served_service(const string& service);
+        uint64_t                                add_served_service(const string& service, function<void(const string&)> on_server);
+        void                                    remove_served_service(const string& service, const uint64_t& client_id);
+        vector<string>                          served_service_servers(const string& service);
         void                                    add_serving_service(const string& service);
         bool                                    add_rpc_service_client(const string& node, const string& service, const string& ip, const int& port);
 
-        bool                                    accept_topic_publish(const string& topic, const string& ip, const int& port);
+        bool                                    accept_topic_publish(const string& topic, const string& ip, const int& port, const int& channel = 0, bool high_priority = false);
         bool                                    accept_service_client(const string& service);
 
+        ParameterStatus                         watch_param_events(const string& name, const string& namespace_, function<void(const google::protobuf::Any&)> cb);
+        void                                    on_param_event(const string& namespace_, const ParamEvent& event);
+        bool                                    read_param_events(const string& namespace_, const ParamBatchRequest& request);
+        void                                    refresh_param_events(const string& namespace_);
+
         const string                            name;
         string                                  this_node_connection_rpc_ip;
         int                                     this_node_connection_rpc_port;
         int                                     this_node_tcp_port;
+        bool                                    topic_multiplex = false;
+        size_t                                  zerocopy_threshold = LARGE_MESSAGE_THRESHOLD;
+        int                                     service_worker_count = DEFAULT_SERVICE_WORKERS;
+        bool                                    local_service = true;   // same host services skip grpc
+        bool                                    param_events = false;   // remote parameters are watched over topics, every node publishes them
 
         shared_ptr<NodeConnectionServerImpl>    connection_rpc_service;
         unique_ptr<grpc::Server>                connection_rpc_server;
@@ -102,16 +124,37 @@ namespace core {
         shared_ptr<TCPServer>                   tcp_topic_server;
         shared_ptr<ParamRPCClientClub>          param_clients;
         shared_ptr<ParamRPCServerImpl>          param_server;
+        shared_ptr<WorkerPool>                  service_workers;
 
         using tf_publisher = shared_ptr<Publisher<std_msgs::TransformD>>;
         tf_publisher                            tf_pub;
         tf_publisher                            static_tf_pub;
+        shared_ptr<Publisher<ParamEvent>>       param_events_pub;
+
+        // remote dynamic parameters watched over the event topics of their nodes
+        struct param_event_slot {
+            function<void(const google::protobuf::Any&)> cb;
+            int64_t                             version = 0;    // last one delivered
+        };
+        unordered_map<string, unordered_map<string, param_event_slot>> param_event_slots;  // node, param_name
+        unordered_set<string>                   param_event_nodes;  // nodes whose topic is subscribed
+        mutex                                   param_events_mtx;
 
         unordered_map<string, string>           topics;
         shared_mutex                            topics_mtx;
 
         unordered_map<string, promise<string>>  services;
-        shared_mutex                            services_mtx;
+        /*
+        every server of a service announces itself to every node, the clients of the service on this node
+        are told about each of them and spread their requests over all.
+        */
+        struct served_service {
+            unordered_map<uint64_t, function<void(const string&)>> clients;    // ServiceClients of this node
+            unordered_map<string, string>       servers;    // server address, node serving it
+        };
+        unordered_map<string, served_service>   served_services;
+        uint64_t                                next_service_client = 1;
+        shared_mutex                            services_mtx;   // guards services, served_services
 
         friend class                            core::NodeRegist;
         friend class                            core::NodeConnectionClient;
@@ -161,7 +204,7 @@ namespace core {
         NodeConnectionClientClub(shared_ptr<core::NodeHandler> nh) ;
         void                                    add_client(const string& node, const string& rpc_srv_addr);
         void                                    delete_client(const string& node);
-        void                                    pull_subscribe_request(const string& topic, const string& ip, const int& port, const string& type_url);
+        void                                    pull_subscribe_request(const string& topic, const string& ip, const int& port, const string& type_url, bool multiplex = false, TopicPriority priority = NORMAL_PRIORITY);
         void                                    pull_serving_service_request(const string& service, const string& ip, const int& port);
         void                                    pull_possess_tree_request(const string& tree, const string& ip, const int& port);
         
@@ -176,20 +219,20 @@ namespace core {
         vector<ConnectionRequest>               tree_requests;
     };
     template<class msg_t>
-    Subscriber NodeHandler::subscribe(const string& topic, void (*cb)(const msg_t*)) {
-        return subscribe_impl(topic, function<void(const msg_t*)>(cb));
+    Subscriber NodeHandler::subscribe(const string& topic, void (*cb)(const msg_t*), TopicPriority priority) {
+        return subscribe_impl(topic, function<void(const msg_t*)>(cb), priority);
     }
 
     template<class msg_t>
-    Subscriber NodeHandler::subscribe(const string& topic, function<void(const msg_t*)> cb) {
-        return subscribe_impl(topic, cb);
+    Subscriber NodeHandler::subscribe(const string& topic, function<void(const msg_t*)> cb, TopicPriority priority) {
+        return subscribe_impl(topic, cb, priority);
     }
 
     template<class msg_t>
-    Subscriber NodeHandler::subscribe_impl(const string& topic, function<void(const msg_t*)> cb) {
+    Subscriber NodeHandler::subscribe_impl(const string& topic, function<void(const msg_t*)> cb, TopicPriority priority) {
         string url = get_typeurl<msg_t>();
         add_subscribed_topic(topic, url);
-        connection_rpc_clients->pull_subscribe_request(topic, this_node_connection_rpc_ip, this_node_tcp_port, url);
+        connection_rpc_clients->pull_subscribe_request(topic, this_node_connection_rpc_ip, this_node_tcp_port, url, topic_multiplex, priority);
         if (!tcp_topic_server->decoders.count(topic)) {
             tcp_topic_server->decoders[topic] = new SpecifiedDecoder<msg_t>();
         }
@@ -197,41 +240,78 @@ namespace core {
         return Subscriber(topic, shared_from_this());
     }
     template<class msg_t>
-    Publisher<msg_t> NodeHandler::advertise(const string& topic) {
+    Publisher<msg_t> NodeHandler::advertise(const string& topic, TopicPriority priority) {
         string url = get_typeurl<msg_t>();
+        if (priority == HIGH_PRIORITY) tcp_topic_clients->set_high_priority_topic(topic);
         add_published_topic(topic, url);
         connection_rpc_service->notify_all();
         return Publisher<msg_t>(topic, shared_from_this());
     }
     template<typename T>
     Publisher<T>::Publisher(const string& topic, shared_ptr<core::NodeHandler> nh) 
-    : pub_topic(topic), nh_(nh){}
+    : pub_topic(topic), nh_(nh), writer_(nh->tcp_topic_clients->get_writer(topic)) {}
     template<typename T>
     void Publisher<T>::publish(const T& msg, bool cache) {
+        // cached messages are replayed to late subscribers, so they are always serialized
+        if (!cache && !writer_->has_subscribers()) return;
         string buffer = core::serialize(msg);
         if (cache) {
             if (!nh_->tcp_topic_clients->write_to_cache(pub_topic, buffer) ) return;
         }
-        nh_->tcp_topic_clients->write_to_socket(pub_topic, buffer);
+        nh_->tcp_topic_clients->write_to_socket(writer_, move(buffer));
+    }
+    template<typename T>
+    int Publisher<T>::getNumSubscribers() {
+        return nh_->tcp_topic_clients->subscriber_count(pub_topic);
+    }
+    template<typename T>
+    bool Publisher<T>::hasSubscribers() {
+        // the lock free check of publish, getNumSubscribers also probes every connection
+        return writer_->has_subscribers();
+    }
+    template<typename T>
+    void Publisher<T>::onSubscribe(SubscriberCallback cb) {
+        nh_->tcp_topic_clients->add_subscribe_callback(pub_topic, cb);
+    }
+    template<typename T>
+    void Publisher<T>::onUnsubscribe(SubscriberCallback cb) {
+        nh_->tcp_topic_clients->add_unsubscribe_callback(pub_topic, cb);
     }
 
     template<typename Request, typename Reply>
-    ServiceServer<Request, Reply> NodeHandler::serviceServer(const string& service, void(*cb)(const Request*, Reply*, ServiceServer<Request, Reply>*, const int&)) {
+    ServiceServer<Request, Reply> NodeHandler::serviceServer(const string& service, void(*cb)(const Request*, Reply*, ServiceServer<Request, Reply>*, const int&), bool inline_callback) {
         if ( find_serving_service(service) ) return ServiceServer<Request, Reply>();
         add_serving_service(service);
         int service_server_port;
-        return ServiceServer<Request, Reply>(service, this_node_connection_rpc_ip, service_server_port, cb, shared_from_this());
+        // inline callbacks must be short, the server handles no other event while one runs
+        return ServiceServer<Request, Reply>(service, this_node_connection_rpc_ip, service_server_port, cb, shared_from_this(), 
+            inline_callback? nullptr: service_workers);
+    }
+    template<typename Request, typename Reply>
+    ServiceServer<Request, Reply> NodeHandler::serviceServer(const string& service, ServiceTask(*cb)(const Request*, Reply*, ServiceServer<Request, Reply>*, const int, CancellationToken), bool inline_callback) {
+        if ( find_serving_service(service) ) return ServiceServer<Request, Reply>();
+        add_serving_service(service);
+        int service_server_port;
+        // a coroutine runs inline until it first suspends, then on the thread that resumes it
+        return ServiceServer<Request, Reply>(service, this_node_connection_rpc_ip, service_server_port, cb, shared_from_this(), 
+            inline_callback? nullptr: service_workers);
     }
     template<typename Request, typename Reply>
     ServiceClient<Request, Reply> NodeHandler::serviceClient(const string& service) {
-        future<string> srv_addr = add_served_service(service);
-        connection_rpc_service->notify_all();
-        return ServiceClient<Request, Reply>(service, ref(srv_addr), shared_from_this());
+        return ServiceClient<Request, Reply>(service, shared_from_this(), service_workers);
     }
 
     template<typename Request, typename Reply>
-    ServiceServer<Request, Reply>::ServiceServer(const string& service, const string& ip, int& rpc_port, FunctionType cb, shared_ptr<core::NodeHandler> nh): 
-    service_name(service), cb_func(cb), nh_(nh) {
+    ServiceServer<Request, Reply>::ServiceServer(const string& service, const string& ip, int& rpc_port, FunctionType cb, shared_ptr<core::NodeHandler> nh, shared_ptr<WorkerPool> pool):
+    ServiceServer(service, ip, rpc_port, cb, nullptr, nh, pool) {}
+
+    template<typename Request, typename Reply>
+    ServiceServer<Request, Reply>::ServiceServer(const string& service, const string& ip, int& rpc_port, AsyncFunctionType cb, shared_ptr<core::NodeHandler> nh, shared_ptr<WorkerPool> pool):
+    ServiceServer(service, ip, rpc_port, nullptr, cb, nh, pool) {}
+
+    template<typename Request, typename Reply>
+    ServiceServer<Request, Reply>::ServiceServer(const string& service, const string& ip, int& rpc_port, FunctionType cb, AsyncFunctionType async_cb, shared_ptr<core::NodeHandler> nh, shared_ptr<WorkerPool> pool): 
+    service_name(service), cb_func(cb), async_cb_func(async_cb), nh_(nh), pool_(pool) {
         valid_ = true;
         stream_id = 0;
         ServerBuilder builder;
@@ -239,6 +319,16 @@ namespace core {
         cq_ = builder.AddCompletionQueue();
         builder.RegisterService(this);
         server_ = builder.BuildAndStart();
+        service_rpc::ServiceLocalHandshake types;
+        types.set_service(service);
+        types.set_request_url(get_typeurl<Request>());
+        types.set_reply_url(get_typeurl<Reply>());
+        local_ = make_unique<LocalServiceServer>(local_service_path(service, ip + ":" + to_string(rpc_port)), types,
+            [this](const uint64_t& connection, const uint64_t& request_id, const int32_t& setting, const int64_t& timeout_us, const char* msg, const int size) {
+                handle_local_request(connection, request_id, setting, timeout_us, msg, size);
+            },
+            [this](const uint64_t& connection) {close_local_connection(connection);});
+        if (!local_->valid()) local_.reset();
         for (int i = 0; i < 10; i++){
             int id = generate_stream_id();
             CreateListenPort(id);
@@ -259,25 +349,54 @@ namespace core {
         nh_->connection_rpc_clients->pull_serving_service_request(service, ip, rpc_port);
     }
 
+    template<typename Request, typename Reply>
+    void ServiceClient<Request, Reply>::watch_servers() {
+        watch_id = nh_->add_served_service(service_name, [this](const string& srv_addr) {add_server(srv_addr);});
+    }
+
+    template<typename Request, typename Reply>
+    ServiceClient<Request, Reply>::~ServiceClient() {
+        nh_->remove_served_service(service_name, watch_id);
+        {
+            unique_lock<mutex> lock(reply_promises_mtx);
+            stopping = true;
+        }
+        deadline_cv.notify_all();
+        if (deadline_thread.joinable()) deadline_thread.join();
+        close_servers();
+    }
+
+    template<typename Request, typename Reply>
+    bool ServiceClient<Request, Reply>::connect_local(server_info& server) {
+        if (!nh_->local_service) return false;
+        service_rpc::ServiceLocalHandshake types;
+        types.set_service(service_name);
+        types.set_request_url(get_typeurl<Request>());
+        types.set_reply_url(get_typeurl<Reply>());
+        auto local = make_unique<LocalServiceClient>();
+        if (!local->connect(local_service_path(service_name, server.srv_addr), types)) return false;
+        unique_lock<mutex> lock(server.write_mtx);
+        if (server.closed.load()) return false;
+        server.local_ = move(local);
+        server.connected = true;
+        LOG(INFO) << "service " << service_name << "@" << server.srv_addr << " is called over its local socket";
+        return true;
+    }
+
     template<typename Request, typename Reply>
     void ServiceClient<Request, Reply>::reset() {
-        unique_lock<shared_mutex> lock(usr_operation_mtx);
-        wait_server_addr = move(nh_->reset_served_service(service_name));
-        wait_server_notify_thread.join();
-        wait_server_notify_thread = thread([this]() mutable {
-            const string srv_addr = wait_server_addr.get();
-            create_connection(srv_addr);
-        });
-        LOG(INFO) << "reset service client stream";
+        close_servers();
+        for (auto &srv_addr: nh_->served_service_servers(service_name)) add_server(srv_addr);
+        LOG(INFO) << "reset service client streams";
     }
 
     template<typename param_t>
-    void NodeHandler::setParameter(const string& name, const param_t val) {
-        param_server->set(name, val);
+    bool NodeHandler::setParameter(const string& name, const param_t val) {
+        return param_server->set(name, val);
     }
     template<typename param_t>
-    void NodeHandler::declareParameter(const string& name, const param_t val, bool is_const) {
-        param_server->declare(name, val, is_const);
+    ParamHandle<param_t> NodeHandler::declareParameter(const string& name, const param_t val, bool is_const) {
+        return param_server->declare(name, val, is_const);
     }
     template<typename param_t>
     bool NodeHandler::getParameter(const string& name, param_t &val) {
@@ -298,8 +417,17 @@ namespace core {
         return param_clients->getRemoteRequest(name, val, namespace_);
     }
     template<typename param_t>
+    ParameterStatus NodeHandler::getRemoteParameter(const string& name, param_t &val, const string& namespace_,
+        const chrono::nanoseconds& timeout, int64_t* version) {
+        return param_clients->getRemoteRequest(name, val, namespace_, timeout, version);
+    }
+    template<typename param_t>
     ParameterStatus NodeHandler::getRemoteDynamicParameter(const string& name, void(*cb)(const param_t), const string& namespace_) {
-        return param_clients->getRemoteRequest(name, cb, namespace_);
+        if (!param_events) return param_clients->getRemoteRequest(name, cb, namespace_);
+        return watch_param_events(name, namespace_, [cb](const google::protobuf::Any& payload) {
+            param_t val;
+            if (payload.UnpackTo(&val)) cb(val);
+        });
     }
 
 }
@@ -31,10 +31,53 @@ namespace core {
         return move(buf);
     }
 
+    /*
+    Frames of a multiplexed topic session:
+    [channel: uint32][length: uint32][payload], both little endian.
+    The first frame of a channel has MUX_CHANNEL_OPEN set in length and carries the topic name,
+    the following frames carry one or more serialized messages of that topic.
+    A large message is split into chunks, every chunk but the last has MUX_MESSAGE_MORE set,
+    so chunks of other channels can be interleaved in between.
+    */
+    const uint32_t MUX_HEADER_SIZE      = 8;
+    const uint32_t MUX_CHANNEL_OPEN     = 0x80000000u;
+    const uint32_t MUX_MESSAGE_MORE     = 0x40000000u;
+    const uint32_t MUX_LENGTH_MASK      = 0x3fffffffu;
+
+    inline string mux_header(const uint32_t channel, const uint32_t length, bool open = false, bool more = false) {
+        string header;
+        header.resize(MUX_HEADER_SIZE);
+        uint8_t* target = reinterpret_cast<uint8_t*>(&header[0]);
+        target = google::protobuf::io::CodedOutputStream::WriteLittleEndian32ToArray(channel, target);
+        const uint32_t flags = (open? MUX_CHANNEL_OPEN: 0) | (more? MUX_MESSAGE_MORE: 0);
+        google::protobuf::io::CodedOutputStream::WriteLittleEndian32ToArray(length | flags, target);
+        return header;
+    }
+
+    inline bool read_mux_header(const string& buf, const size_t offset, uint32_t& channel, uint32_t& length, bool& open, bool& more) {
+        if (offset + MUX_HEADER_SIZE > buf.size()) return false;
+        const uint8_t* source = reinterpret_cast<const uint8_t*>(buf.data() + offset);
+        source = google::protobuf::io::CodedInputStream::ReadLittleEndian32FromArray(source, &channel);
+        google::protobuf::io::CodedInputStream::ReadLittleEndian32FromArray(source, &length);
+        open = length & MUX_CHANNEL_OPEN;
+        more = length & MUX_MESSAGE_MORE;
+        length &= MUX_LENGTH_MASK;
+        return true;
+    }
+
+    // size of the length prefixed message at the front of buf, 0 if the prefix is not complete yet
+    inline size_t read_message_size(const char* buf, const size_t size) {
+        if (size < 4) return 0;
+        uint32_t msg_size;
+        google::protobuf::io::CodedInputStream::ReadLittleEndian32FromArray(reinterpret_cast<const uint8_t*>(buf), &msg_size);
+        return 4 + msg_size;
+    }
+
     class Decoder {
         public:
         Decoder()          = default;
-        virtual int        decode(const string& raw_msg) = 0;
+        int                decode(const string& raw_msg) {return decode(raw_msg.data(), raw_msg.size());}
+        virtual int        decode(const char* raw_msg, const int size) = 0;
         virtual void       handle() = 0;
     };
     template<typename T>
@@ -45,14 +88,14 @@ namespace core {
         void add_callback(func_t func) {
             functions.push_back(func);
         }
-        int decode(const string& buf) override {
+        using Decoder::decode;
+        int decode(const char* buf, const int buf_size) override {
             int total_bytes_consumed = 0;
-            int buf_size = buf.size();
             int offset = 0;
 
             while (offset + 4 <= buf_size) {
                 uint32_t msg_size = 0;
-                google::protobuf::io::CodedInputStream coded_input(reinterpret_cast<const uint8_t*>(buf.data() + offset), buf_size - offset);
+                google::protobuf::io::CodedInputStream coded_input(reinterpret_cast<const uint8_t*>(buf + offset), buf_size - offset);
                 coded_input.ReadLittleEndian32(&msg_size);
 
                 if (offset + 4 + msg_size > buf_size) {
@@ -60,7 +103,7 @@ namespace core {
                 }
 
                 T msg;
-                if (!msg.ParseFromArray(buf.data() + offset + 4, msg_size)) {
+                if (!msg.ParseFromArray(buf + offset + 4, msg_size)) {
                     return 0;
                 }
                 msgs.push_back(move(msg));
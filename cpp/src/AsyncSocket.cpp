@@ -2,7 +2,7 @@
 namespace core {
         /*
     Following is the function associate with epoll or kqueue. Determined by your OS, as for MacOS we use kqueue, for linux we use epoll.
-    We have only three function, init, add and delete event.
+    We have init, add, delete and (epoll only) modify event.
     */
     int Socket::set_nonblock(const int& fd) {
         int flags = fcntl(fd, F_GETFL, 0);
@@ -25,6 +25,45 @@ namespace core {
         }
         return sockfd;
     }
+    int Socket::set_high_priority(const int& fd) {
+        /*
+        low latency settings for control traffic: no nagle delay, a small send buffer so
+        queued data cannot pile up in the kernel, and expedited forwarding DSCP.
+        */
+        int flag = 1;
+        if (setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &flag, sizeof(flag)) < 0) {
+            LOG(ERROR) << "Failed to set TCP_NODELAY: " << errno;
+            return -1;
+        }
+        int send_buffer_size = HIGH_PRIORITY_SEND_BUFFER_SIZE;
+        if (setsockopt(fd, SOL_SOCKET, SO_SNDBUF, &send_buffer_size, sizeof(send_buffer_size)) < 0) {
+            LOG(WARNING) << "Failed to set send buffer size: " << errno;
+        }
+        int tos = HIGH_PRIORITY_DSCP << 2;
+        if (setsockopt(fd, IPPROTO_IP, IP_TOS, &tos, sizeof(tos)) < 0) {
+            LOG(WARNING) << "Failed to set IP_TOS: " << errno;
+        }
+    #ifdef __linux__
+        int priority = HIGH_PRIORITY_SOCKET_PRIORITY;
+        if (setsockopt(fd, SOL_SOCKET, SO_PRIORITY, &priority, sizeof(priority)) < 0) {
+            LOG(WARNING) << "Failed to set SO_PRIORITY: " << errno;
+        }
+    #endif
+        return 0;
+    }
+    int Socket::set_zerocopy(const int& fd) {
+        // MSG_ZEROCOPY is linux only, callers fall back to plain copying writes
+    #if defined(__linux__) && defined(SO_ZEROCOPY)
+        int flag = 1;
+        if (setsockopt(fd, SOL_SOCKET, SO_ZEROCOPY, &flag, sizeof(flag)) < 0) {
+            LOG(WARNING) << "Failed to set SO_ZEROCOPY: " << errno;
+            return -1;
+        }
+        return 0;
+    #else
+        return -1;
+    #endif
+    }
 
     #ifdef __linux__
     int Socket::add_epoll_event(const int& fd, const int& events) {
@@ -48,6 +87,19 @@ namespace core {
         }
         return 0;
     }
+    int Socket::modify_epoll_event(const int& fd, const int& events) {
+        struct epoll_event event;
+        memset(&event, 0, sizeof(struct epoll_event));
+
+        event.events  = events;
+        event.data.fd = fd;
+
+        if (epoll_ctl(epoll_fd, EPOLL_CTL_MOD, fd, &event) < 0) {
+            LOG(ERROR) << "Failed to modify epoll event: " << errno;
+            return -1;
+        }
+        return 0;
+    }
     int Socket::init_epoll() {
         epoll_fd = epoll_create(maxevents);
         if (epoll_fd < 0) {
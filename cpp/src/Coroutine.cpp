@@ -0,0 +1,54 @@
+#include "Coroutine.hpp"
+#include <algorithm>
+namespace core {
+CancellationToken::CancellationToken() : state_(make_shared<state>()) {}
+
+bool CancellationToken::cancelled() const {
+    unique_lock<mutex> lock(state_->mtx);
+    return state_->cancelled;
+}
+
+void CancellationToken::cancel() {
+    vector<pair<uint64_t, function<void()>>> callbacks;
+    {
+        unique_lock<mutex> lock(state_->mtx);
+        if (state_->cancelled) return;
+        state_->cancelled = true;
+        callbacks.swap(state_->callbacks);
+    }
+    state_->cv.notify_all();
+    // outside the lock, a callback may cancel other calls or check this token
+    for (auto &cb: callbacks) cb.second();
+}
+
+uint64_t CancellationToken::on_cancel(function<void()> cb) {
+    {
+        unique_lock<mutex> lock(state_->mtx);
+        if (!state_->cancelled) {
+            const uint64_t id = state_->next_id++;
+            state_->callbacks.emplace_back(id, move(cb));
+            return id;
+        }
+    }
+    cb();
+    return 0;
+}
+
+void CancellationToken::remove_on_cancel(const uint64_t& id) {
+    unique_lock<mutex> lock(state_->mtx);
+    auto &callbacks = state_->callbacks;
+    callbacks.erase(remove_if(callbacks.begin(), callbacks.end(), [&](const pair<uint64_t, function<void()>>& cb) {return cb.first == id;}), callbacks.end());
+}
+
+bool CancellationToken::wait_for(const chrono::nanoseconds& timeout) const {
+    unique_lock<mutex> lock(state_->mtx);
+    return state_->cv.wait_for(lock, timeout, [this]() {return state_->cancelled;});
+}
+
+void ServiceTask::start(function<void()> on_done) {
+    coroutine_handle<promise_type> handle = handle_;
+    handle_ = nullptr;
+    handle.promise().on_done = move(on_done);
+    handle.resume();
+}
+}
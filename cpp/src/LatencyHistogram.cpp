@@ -0,0 +1,54 @@
+#include "LatencyHistogram.hpp"
+namespace core {
+LatencyHistogram::LatencyHistogram() {
+    for (auto &bucket_: buckets_) bucket_ = 0;
+}
+
+int LatencyHistogram::bucket(const uint64_t& us) {
+    if (us < 4) return us;
+    if (us >> 32) return BUCKETS - 1;
+    int exponent = 63 - __builtin_clzll(us);
+    const int sub = (us >> (exponent - 2)) & 3;
+    return 4 + (exponent - 2) * 4 + sub;
+}
+
+chrono::microseconds LatencyHistogram::bucket_bound(const int& bucket) {
+    if (bucket < 4) return chrono::microseconds(bucket + 1);
+    const int exponent = (bucket - 4) / 4 + 2;
+    const int sub = (bucket - 4) % 4;
+    return chrono::microseconds(static_cast<int64_t>(5 + sub) << (exponent - 2));
+}
+
+void LatencyHistogram::record(const chrono::nanoseconds& time) {
+    const uint64_t us = time.count() > 0 ? time.count() / 1000 : 0;
+    buckets_[bucket(us)].fetch_add(1, memory_order_relaxed);
+    sum_.fetch_add(us, memory_order_relaxed);
+}
+
+LatencyHistogram::Snapshot LatencyHistogram::snapshot() const {
+    // the fields are read one by one, a snapshot taken under load may be off by the records in between
+    Snapshot snapshot_;
+    snapshot_.buckets.resize(BUCKETS);
+    for (int i = 0; i < BUCKETS; i++) {
+        snapshot_.buckets[i] = buckets_[i].load(memory_order_relaxed);
+        snapshot_.count += snapshot_.buckets[i];
+    }
+    snapshot_.sum = chrono::microseconds(sum_.load(memory_order_relaxed));
+    return snapshot_;
+}
+
+chrono::microseconds LatencyHistogram::Snapshot::mean() const {
+    return count ? chrono::microseconds(sum.count() / static_cast<int64_t>(count)) : chrono::microseconds(0);
+}
+
+chrono::microseconds LatencyHistogram::Snapshot::percentile(const double& p) const {
+    if (count == 0) return chrono::microseconds(0);
+    const uint64_t rank = max<uint64_t>(1, static_cast<uint64_t>(p / 100 * count + 0.5));
+    uint64_t seen = 0;
+    for (int i = 0; i < buckets.size(); i++) {
+        seen += buckets[i];
+        if (seen >= rank) return bucket_bound(i);
+    }
+    return bucket_bound(buckets.size() - 1);
+}
+}
@@ -0,0 +1,408 @@
+#include "LocalService.hpp"
+#include "common.hpp"
+#include <sstream>
+#include <iomanip>
+#include <stddef.h>
+#ifdef MSG_NOSIGNAL
+#define LOCAL_SEND_FLAGS MSG_NOSIGNAL
+#else
+#define LOCAL_SEND_FLAGS 0
+#endif
+namespace core {
+string local_service_path(const string& service, const string& srv_addr) {
+    // fnv-1a, server and client may be built apart so std::hash is not an option
+    uint64_t hash = 1469598103934665603ull;
+    for (unsigned char c: service + "@" + srv_addr) {
+        hash ^= c;
+        hash *= 1099511628211ull;
+    }
+    stringstream name;
+    name << "core_service_" << hex << setw(16) << setfill('0') << hash;
+#ifdef __linux__
+    return string(1, '\0') + name.str(); // abstract namespace, nothing is left on the file system
+#elif __APPLE__
+    return "/tmp/" + name.str() + ".sock";
+#endif
+}
+
+static socklen_t unix_address(const string& path, struct sockaddr_un& addr) {
+    memset(&addr, 0, sizeof(addr));
+    addr.sun_family = AF_UNIX;
+    memcpy(addr.sun_path, path.data(), min(path.size(), sizeof(addr.sun_path) - 1));
+    return offsetof(struct sockaddr_un, sun_path) + min(path.size(), sizeof(addr.sun_path) - 1);
+}
+
+static bool send_all(const int& fd, const string& data) {
+    size_t sent = 0;
+    while (sent < data.size()) {
+        ssize_t ret = send(fd, data.data() + sent, data.size() - sent, LOCAL_SEND_FLAGS);
+        if (ret < 0) {
+            if (errno == EINTR) continue;
+            return false;
+        }
+        sent += ret;
+    }
+    return true;
+}
+
+string local_call_header(const uint64_t& request_id, const int32_t& code, const int64_t& time0, const int64_t& time1) {
+    string header;
+    header.resize(LOCAL_CALL_HEADER_SIZE);
+    uint8_t* target = reinterpret_cast<uint8_t*>(&header[0]);
+    target = google::protobuf::io::CodedOutputStream::WriteLittleEndian64ToArray(request_id, target);
+    target = google::protobuf::io::CodedOutputStream::WriteLittleEndian32ToArray(static_cast<uint32_t>(code), target);
+    target = google::protobuf::io::CodedOutputStream::WriteLittleEndian64ToArray(static_cast<uint64_t>(time0), target);
+    google::protobuf::io::CodedOutputStream::WriteLittleEndian64ToArray(static_cast<uint64_t>(time1), target);
+    return header;
+}
+
+size_t read_local_call(const string& buf, const size_t offset, uint64_t& request_id, int32_t& code, int64_t& time0, int64_t& time1) {
+    if (offset + LOCAL_CALL_HEADER_SIZE > buf.size()) return 0;
+    const size_t msg_size = read_message_size(buf.data() + offset + LOCAL_CALL_HEADER_SIZE, buf.size() - offset - LOCAL_CALL_HEADER_SIZE);
+    if (msg_size == 0 || offset + LOCAL_CALL_HEADER_SIZE + msg_size > buf.size()) return 0;
+    const uint8_t* source = reinterpret_cast<const uint8_t*>(buf.data() + offset);
+    uint32_t code_;
+    uint64_t time0_, time1_;
+    source = google::protobuf::io::CodedInputStream::ReadLittleEndian64FromArray(source, &request_id);
+    source = google::protobuf::io::CodedInputStream::ReadLittleEndian32FromArray(source, &code_);
+    source = google::protobuf::io::CodedInputStream::ReadLittleEndian64FromArray(source, &time0_);
+    google::protobuf::io::CodedInputStream::ReadLittleEndian64FromArray(source, &time1_);
+    code = static_cast<int32_t>(code_);
+    time0 = static_cast<int64_t>(time0_);
+    time1 = static_cast<int64_t>(time1_);
+    return LOCAL_CALL_HEADER_SIZE + msg_size;
+}
+
+LocalServiceServer::LocalServiceServer(const string& path, const service_rpc::ServiceLocalHandshake& types, CallHandler on_call, CloseHandler on_close) :
+path_(path), types_(types), on_call_(on_call), on_close_(on_close) {
+    running = false;
+    listen_fd = socket(AF_UNIX, SOCK_STREAM, 0);
+    if (listen_fd < 0) {
+        LOG(ERROR) << "Failed to create local service socket: " << errno;
+        return;
+    }
+    struct sockaddr_un addr;
+    socklen_t addr_len = unix_address(path_, addr);
+#ifdef __APPLE__
+    unlink(path_.c_str());
+#endif
+    if (::bind(listen_fd, (struct sockaddr*)&addr, addr_len) < 0 || listen(listen_fd, 10) < 0 || set_nonblock(listen_fd) < 0) {
+        LOG(ERROR) << "Failed to listen on local service socket: " << errno;
+        close(listen_fd);
+        listen_fd = -1;
+        return;
+    }
+#ifdef __linux__
+    init_epoll();
+    add_epoll_event(listen_fd, EPOLLIN);
+#elif __APPLE__
+    init_kqueue();
+    add_kqueue_event(listen_fd, EVFILT_READ, EV_ADD | EV_ENABLE);
+#endif
+    running = true;
+    io_thread = thread(&LocalServiceServer::io_loop, this);
+}
+
+LocalServiceServer::~LocalServiceServer() {
+    running = false;
+    if (io_thread.joinable()) io_thread.join();
+    if (listen_fd < 0) return;
+    close(listen_fd);
+#ifdef __APPLE__
+    unlink(path_.c_str());
+#endif
+}
+
+bool LocalServiceServer::valid() {
+    return listen_fd >= 0;
+}
+
+void LocalServiceServer::io_loop() {
+    int event_ret;
+    int fd;
+    while (running.load() && core::ok()) {
+    #ifdef __linux__
+        event_ret = epoll_wait(epoll_fd, events, maxevents, 100);
+    #elif __APPLE__
+        struct timespec ts = { 0, 100000000 };
+        event_ret = kevent(kq_fd, NULL, 0, events, maxevents, &ts);
+    #endif
+        for (int i = 0; i < event_ret; i++) {
+        #ifdef __linux__
+            fd = events[i].data.fd;
+        #elif __APPLE__
+            fd = events[i].ident;
+        #endif
+            if (fd == listen_fd) accept_connection();
+        #ifdef __linux__
+            else {
+                if (events[i].events & EPOLLOUT) flush_connection(fd);
+                if (events[i].events & ~EPOLLOUT) handle_connection(fd);
+            }
+        #elif __APPLE__
+            else if (events[i].filter == EVFILT_WRITE) flush_connection(fd);
+            else handle_connection(fd);
+        #endif
+        }
+    }
+}
+
+void LocalServiceServer::accept_connection() {
+    while (true) {
+        int fd = accept(listen_fd, NULL, NULL);
+        if (fd < 0) {
+            if (errno != EAGAIN && errno != EWOULDBLOCK) LOG(ERROR) << "Failed to accept local service client " << errno;
+            return;
+        }
+        // neither reads nor replies wait, a reply that does not fit is left in the outbox of the connection
+        set_nonblock(fd);
+    #ifdef SO_NOSIGPIPE
+        int flag = 1;
+        setsockopt(fd, SOL_SOCKET, SO_NOSIGPIPE, &flag, sizeof(flag));
+    #endif
+        auto connection = make_shared<connection_info>();
+        connection->fd = fd;
+        {
+            unique_lock<shared_mutex> lock(mtx);
+            connection->id = next_connection++;
+            fd_connections[fd] = connection;
+            connections[connection->id] = connection;
+        }
+    #ifdef __linux__
+        add_epoll_event(fd, EPOLLIN);
+    #elif __APPLE__
+        add_kqueue_event(fd, EVFILT_READ, EV_ADD | EV_ENABLE);
+    #endif
+    }
+}
+
+void LocalServiceServer::handle_connection(const int& fd) {
+    shared_ptr<connection_info> connection;
+    {
+        shared_lock<shared_mutex> lock(mtx);
+        auto it = fd_connections.find(fd);
+        if (it == fd_connections.end()) return;
+        connection = it->second;
+    }
+    char buffer_once[65536];
+    while (true) {
+        ssize_t ret = recv(fd, buffer_once, sizeof(buffer_once), MSG_DONTWAIT);
+        if (ret == 0 || (ret < 0 && errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR)) {
+            return close_connection(fd);
+        }
+        if (ret < 0) break;
+        connection->buffer.append(buffer_once, ret);
+    }
+    string& data = connection->buffer;
+    if (!connection->accepted && !handshake(*connection)) return;
+    size_t offset = 0;
+    uint64_t request_id;
+    int32_t code;
+    int64_t timeout_us, unused;
+    while (size_t frame_size = read_local_call(data, offset, request_id, code, timeout_us, unused)) {
+        const size_t msg_offset = offset + LOCAL_CALL_HEADER_SIZE + 4;
+        on_call_(connection->id, request_id, code, timeout_us, data.data() + msg_offset, offset + frame_size - msg_offset);
+        offset += frame_size;
+    }
+    data.erase(0, offset);
+}
+
+bool LocalServiceServer::handshake(connection_info& connection) {
+    const size_t size = read_message_size(connection.buffer.data(), connection.buffer.size());
+    if (size == 0 || size > connection.buffer.size()) return false;
+    service_rpc::ServiceLocalHandshake request;
+    request.ParseFromArray(connection.buffer.data() + 4, size - 4);
+    connection.buffer.erase(0, size);
+    service_rpc::ServiceLocalHandshake reply = types_;
+    reply.set_accepted(request.service() == types_.service() &&
+        request.request_url() == types_.request_url() && request.reply_url() == types_.reply_url());
+    if (!reply.accepted()) LOG(WARNING) << "local client of service " << request.service() << " has mismatched types, refused";
+    bool sent;
+    {
+        unique_lock<mutex> lock(connection.write_mtx);
+        sent = send_queued(connection, serialize(reply));
+    }
+    if (!sent || !reply.accepted()) {
+        close_connection(connection.fd);
+        return false;
+    }
+    connection.accepted = true;
+    return true;
+}
+
+void LocalServiceServer::close_connection(const int& fd) {
+    uint64_t id;
+    shared_ptr<connection_info> connection;
+    {
+        unique_lock<shared_mutex> lock(mtx);
+        auto it = fd_connections.find(fd);
+        if (it == fd_connections.end()) return;
+        connection = it->second;
+        id = connection->id;
+        connections.erase(id);
+        fd_connections.erase(it);
+    }
+    {
+        unique_lock<mutex> lock(connection->write_mtx);
+    #ifdef __linux__
+        delete_epoll_event(fd);
+    #elif __APPLE__
+        delete_kqueue_event(fd, EVFILT_READ);
+        if (connection->want_write) delete_kqueue_event(fd, EVFILT_WRITE);
+    #endif
+        connection->want_write = true;  // never watched again
+    }
+    // writers holding the connection fail from now on, the fd is closed with its last reference
+    shutdown(fd, SHUT_RDWR);
+    on_close_(id);
+}
+
+bool LocalServiceServer::write(const uint64_t& connection, const uint64_t& request_id, const int32_t& code, const string& msg,
+const int64_t& queue_us, const int64_t& execute_us) {
+    shared_ptr<connection_info> info;
+    {
+        shared_lock<shared_mutex> lock(mtx);
+        auto it = connections.find(connection);
+        if (it == connections.end()) return false;
+        info = it->second;
+    }
+    unique_lock<mutex> lock(info->write_mtx);
+    info->feedback.erase(request_id);   // the reply ends the call, its last feedback is stale
+    return send_queued(*info, local_call_header(request_id, code, queue_us, execute_us) + msg);
+}
+
+bool LocalServiceServer::write_feedback(const uint64_t& connection, const uint64_t& request_id, const string& msg) {
+    shared_ptr<connection_info> info;
+    {
+        shared_lock<shared_mutex> lock(mtx);
+        auto it = connections.find(connection);
+        if (it == connections.end()) return false;
+        info = it->second;
+    }
+    string frame = local_call_header(request_id, service_rpc::ServiceRPCReply::FEEDBACK) + msg;
+    unique_lock<mutex> lock(info->write_mtx);
+    if (info->outbox.empty()) return send_queued(*info, frame);
+    // the socket is full, only the newest feedback of the call waits for it
+    info->feedback[request_id] = move(frame);
+    return true;
+}
+
+bool LocalServiceServer::send_queued(connection_info& connection, const string& data) {
+    // called with write_mtx held
+    size_t sent = 0;
+    while (connection.outbox.empty() && sent < data.size()) {
+        ssize_t ret = send(connection.fd, data.data() + sent, data.size() - sent, LOCAL_SEND_FLAGS);
+        if (ret < 0 && errno == EINTR) continue;
+        if (ret < 0 && errno != EAGAIN && errno != EWOULDBLOCK) return false;
+        if (ret < 0) break;
+        sent += ret;
+    }
+    if (sent == data.size()) return true;
+    if (connection.outbox.size() + data.size() - sent > LOCAL_OUTBOX_LIMIT) {
+        LOG(WARNING) << "local service client stopped reading its replies, disconnected";
+        shutdown(connection.fd, SHUT_RDWR); // the io loop sees the hang up and closes it
+        return false;
+    }
+    connection.outbox.append(data, sent, string::npos);
+    watch_writable(connection, true);
+    return true;
+}
+
+void LocalServiceServer::flush_connection(const int& fd) {
+    shared_ptr<connection_info> connection;
+    {
+        shared_lock<shared_mutex> lock(mtx);
+        auto it = fd_connections.find(fd);
+        if (it == fd_connections.end()) return;
+        connection = it->second;
+    }
+    unique_lock<mutex> lock(connection->write_mtx);
+    string& outbox = connection->outbox;
+    while (true) {
+        size_t sent = 0;
+        while (sent < outbox.size()) {
+            ssize_t ret = send(fd, outbox.data() + sent, outbox.size() - sent, LOCAL_SEND_FLAGS);
+            if (ret < 0 && errno == EINTR) continue;
+            if (ret < 0) break;     // still full, or broken and the read side reports it
+            sent += ret;
+        }
+        outbox.erase(0, sent);
+        if (!outbox.empty() || connection->feedback.empty()) break;
+        // the replies are out, the feedback held back behind them follows
+        for (auto &feedback: connection->feedback) outbox += feedback.second;
+        connection->feedback.clear();
+    }
+    if (outbox.empty()) watch_writable(*connection, false);
+}
+
+void LocalServiceServer::watch_writable(connection_info& connection, const bool& enable) {
+    // called with write_mtx held
+    if (connection.want_write == enable) return;
+    connection.want_write = enable;
+#ifdef __linux__
+    modify_epoll_event(connection.fd, enable ? EPOLLIN | EPOLLOUT : EPOLLIN);
+#elif __APPLE__
+    if (enable) add_kqueue_event(connection.fd, EVFILT_WRITE, EV_ADD | EV_ENABLE);
+    else delete_kqueue_event(connection.fd, EVFILT_WRITE);
+#endif
+}
+
+LocalServiceClient::~LocalServiceClient() {
+    if (fd >= 0) close(fd);
+}
+
+bool LocalServiceClient::connect(const string& path, const service_rpc::ServiceLocalHandshake& types) {
+    fd = socket(AF_UNIX, SOCK_STREAM, 0);
+    if (fd < 0) return false;
+#ifdef SO_NOSIGPIPE
+    int flag = 1;
+    setsockopt(fd, SOL_SOCKET, SO_NOSIGPIPE, &flag, sizeof(flag));
+#endif
+    struct sockaddr_un addr;
+    socklen_t addr_len = unix_address(path, addr);
+    service_rpc::ServiceLocalHandshake reply;
+    size_t size = 0;
+    if (::connect(fd, (struct sockaddr*)&addr, addr_len) == 0 && send_all(fd, serialize(types)) &&
+    fill(4) && (size = read_message_size(buffer.data(), buffer.size())) && fill(size) &&
+    reply.ParseFromArray(buffer.data() + 4, size - 4) && reply.accepted()) {
+        buffer.erase(0, size);
+        return true;
+    }
+    close(fd);
+    fd = -1;
+    buffer.clear();
+    return false;
+}
+
+void LocalServiceClient::disconnect() {
+    if (fd >= 0) shutdown(fd, SHUT_RDWR);
+}
+
+bool LocalServiceClient::fill(const size_t size) {
+    char buffer_once[65536];
+    while (buffer.size() < size) {
+        ssize_t ret = recv(fd, buffer_once, sizeof(buffer_once), 0);
+        if (ret < 0 && errno == EINTR) continue;
+        if (ret <= 0) return false;
+        buffer.append(buffer_once, ret);
+    }
+    return true;
+}
+
+bool LocalServiceClient::write(const uint64_t& request_id, const int32_t& code, const string& msg, const int64_t& timeout_us) {
+    unique_lock<mutex> lock(write_mtx);
+    if (fd < 0) return false;
+    return send_all(fd, local_call_header(request_id, code, timeout_us) + msg);
+}
+
+bool LocalServiceClient::read(uint64_t& request_id, int32_t& code, string& msg, int64_t& queue_us, int64_t& execute_us) {
+    size_t frame_size;
+    while (!(frame_size = read_local_call(buffer, 0, request_id, code, queue_us, execute_us))) {
+        if (!fill(buffer.size() + 1)) return false;
+    }
+    const size_t msg_offset = LOCAL_CALL_HEADER_SIZE + 4;
+    msg.assign(buffer.data() + msg_offset, frame_size - msg_offset);
+    buffer.erase(0, frame_size);
+    return true;
+}
+}
@@ -1,4 +1,10 @@
 #include "ParamRPC.hpp"
+#include <fstream>
+#include <cstring>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
 namespace core {
 Status ParamRPCServerImpl::getRemoteParam(ServerContext* context, 
     const getParamRPCRequest*request, ServerWriter<getParamRPCReply>* writer) {
@@ -6,18 +12,19 @@ Status ParamRPCServerImpl::getRemoteParam(ServerContext* context,
     int version = 0;
     while (core::ok() && !context->IsCancelled()) {
         getParamRPCReply reply;
-        if (find_param(name)) {
-            version = params_version[name].load();
-            reply.set_status(ParameterStatus::NORMAL);
+        reply.set_status(ParameterStatus::TMEP_NOT_AVALIABLE);
+        {
             shared_lock<shared_mutex> lock(params_mtx);
-            reply.mutable_payload()->CopyFrom(params[name]->getRemoteValue());
-        } else {
-            reply.set_status(ParameterStatus::TMEP_NOT_AVALIABLE);
+            if (param_entry* entry = find_entry(name)) {
+                version = entry->version.load();
+                reply.set_status(ParameterStatus::NORMAL);
+                reply.mutable_payload()->CopyFrom(packed(*entry));
+            }
         }
         writer->Write(reply);
         unique_lock<mutex> lock(mtx);
         cv.wait(lock, [&]() {
-            return (find_param(name) && version != params_version[name].load()) || !core::ok();
+            return version != version_of(name) || !core::ok();
         });
     }
     return Status::OK;
@@ -26,57 +33,368 @@ Status ParamRPCServerImpl::getRemoteParam(ServerContext* context,
 Status ParamRPCServerImpl::setRemoteParam(ServerContext* context, 
     const setParamRPCRequest*request, setParamRPCReply* reply) {
     const string name = request->name();
-    if (is_const(name)) {
-        reply->set_status(ParameterStatus::NOT_CHANGEABLE);
-    } else if (!find_param(name)) {
-        reply->set_status(ParameterStatus::TMEP_NOT_AVALIABLE);
-    } else {
+    {
+        unique_lock<shared_mutex> lock(params_mtx);
+        param_entry* entry = find_entry(name);
+        reply->set_status(check_set(entry, request->payload()));
+        if (reply->status() != ParameterStatus::NORMAL) return Status::OK;
+        entry->value->setRemoteValue(request->payload());
+        entry->version++;
+    }
+    cv.notify_all();
+    notify_watchers(name);
+    return Status::OK;
+}
+Status ParamRPCServerImpl::watchRemoteParams(ServerContext* context,
+    ServerReaderWriter<ParamWatchUpdate, ParamWatchRequest>* stream) {
+    auto session = make_shared<watch_session>();
+    // the writer sends whatever changed since its last write, so a slow peer gets fewer and larger updates
+    thread writer([this, session, stream]() {
+        while (true) {
+            vector<string> names;
+            {
+                unique_lock<mutex> lock(session->mtx);
+                session->cv.wait(lock, [&]() {return session->closed || !session->dirty.empty();});
+                if (session->closed) return;
+                names.assign(session->dirty.begin(), session->dirty.end());
+                session->dirty.clear();
+            }
+            ParamWatchUpdate update;
+            for (auto &name: names) {
+                ParamDelta* delta = update.add_deltas();
+                delta->set_name(name);
+                delta->set_status(ParameterStatus::TMEP_NOT_AVALIABLE);
+                shared_lock<shared_mutex> lock(params_mtx);
+                param_entry* entry = find_entry(name);
+                if (!entry) continue;
+                delta->set_status(ParameterStatus::NORMAL);
+                delta->mutable_payload()->CopyFrom(packed(*entry));
+            }
+            if (!stream->Write(update)) return;
+        }
+    });
+    auto mark = [session](const string& name) {
+        unique_lock<mutex> lock(session->mtx);
+        session->dirty.insert(name);
+        session->cv.notify_one();
+    };
+    ParamWatchRequest request;
+    while (core::ok() && stream->Read(&request)) {
+        for (auto &name: request.add()) {
+            if (session->watching.count(name)) continue;
+            auto watcher = make_shared<param_watcher>();
+            watcher->notify = [mark, name]() {mark(name);};
+            session->watching[name] = watcher;
+            add_watcher(name, watcher);
+            mark(name);
+        }
+        for (auto &name: request.remove()) {
+            auto it = session->watching.find(name);
+            if (it == session->watching.end()) continue;
+            remove_watcher(name, it->second);
+            session->watching.erase(it);
+            unique_lock<mutex> lock(session->mtx);
+            session->dirty.erase(name);
+        }
+    }
+    for (auto &watching: session->watching) remove_watcher(watching.first, watching.second);
+    session->watching.clear();
+    {
+        unique_lock<mutex> lock(session->mtx);
+        session->closed = true;
+    }
+    session->cv.notify_all();
+    writer.join();
+    return Status::OK;
+}
+
+Status ParamRPCServerImpl::batchRemoteParams(ServerContext* context,
+    const ParamBatchRequest* request, ParamBatchReply* reply) {
+    reply->set_status(ParameterStatus::NORMAL);
+    vector<string> changed;
+    {
+        // one lock over the whole batch, gets see every set of it or none and no set comes in between
         unique_lock<shared_mutex> lock(params_mtx);
-        params[name]->setRemoteValue(request->payload());
-        reply->set_status(ParameterStatus::NORMAL);
-        params_version[name]++;
-        cv.notify_all();
+        // version of a parameter once the earlier sets of the batch are applied, a second
+        // compare-and-set expecting the same version as the first one fails as it would one by one
+        unordered_map<string, int64_t> planned;
+        for (auto &entry: request->set()) {
+            ParamEntry* result = reply->add_set();
+            result->set_name(entry.name());
+            param_entry* param = find_entry(entry.name());
+            auto earlier = planned.find(entry.name());
+            ParameterStatus status = check_set(param, entry.payload(), earlier == planned.end() ? entry.version() : 0);
+            if (status == ParameterStatus::NORMAL && earlier != planned.end() && entry.version() != 0 && entry.version() != earlier->second) {
+                status = ParameterStatus::VERSION_MISMATCH;
+            }
+            if (status == ParameterStatus::NORMAL) planned[entry.name()] = (earlier == planned.end() ? param->version.load() : earlier->second) + 1;
+            result->set_status(status);
+            if (result->status() != ParameterStatus::NORMAL) reply->set_status(result->status());
+        }
+        for (int i = 0; i < request->set_size(); i++) {
+            ParamEntry* result = reply->mutable_set(i);
+            if (result->status() != ParameterStatus::NORMAL) continue;
+            if (request->atomic() && reply->status() != ParameterStatus::NORMAL) {
+                result->set_status(ParameterStatus::TMEP_NOT_AVALIABLE);    // not applied, another set failed
+                continue;
+            }
+            param_entry* entry = params[result->name()];
+            entry->value->setRemoteValue(request->set(i).payload());
+            result->set_version(++entry->version);
+            changed.push_back(result->name());
+        }
+        for (auto &name: request->get()) {
+            const bool prefix = !name.empty() && name.back() == '*';
+            vector<string> names;
+            if (!prefix) names.push_back(name);
+            else {
+                for (auto &param: params) {
+                    if (param.first.compare(0, name.size() - 1, name, 0, name.size() - 1) == 0) names.push_back(param.first);
+                }
+                sort(names.begin(), names.end());
+            }
+            for (auto &name_: names) {
+                ParamEntry* got = reply->add_got();
+                got->set_name(name_);
+                auto it = params.find(name_);
+                if (it == params.end()) {
+                    got->set_status(ParameterStatus::TMEP_NOT_AVALIABLE);
+                    continue;
+                }
+                got->set_status(ParameterStatus::NORMAL);
+                got->mutable_payload()->CopyFrom(packed(*it->second));
+                got->set_version(it->second->version.load());
+            }
+        }
     }
+    if (!changed.empty()) cv.notify_all();
+    for (auto &name: changed) notify_watchers(name);
     return Status::OK;
 }
+
+ParameterStatus ParamRPCServerImpl::check_set(param_entry* entry, const google::protobuf::Any& payload, const int64_t& expected_version) {
+    if (!entry) return ParameterStatus::TMEP_NOT_AVALIABLE;
+    if (entry->is_const) return ParameterStatus::NOT_CHANGEABLE;
+    if (type_of(payload) != entry->type) return ParameterStatus::TYPE_MISMATCH;
+    if (expected_version != 0 && expected_version != entry->version.load()) return ParameterStatus::VERSION_MISMATCH;
+    return ParameterStatus::NORMAL;
+}
+
+bool ParamRPCServerImpl::save(const string& path) {
+    ParamSnapshot snapshot;
+    {
+        shared_lock<shared_mutex> lock(params_mtx);
+        for (auto &param: entries) {
+            ParamSnapshotEntry* entry = snapshot.add_params();
+            entry->set_name(param.name);
+            entry->mutable_payload()->CopyFrom(packed(param));
+            entry->set_version(param.version.load());
+            entry->set_is_const(param.is_const);
+        }
+    }
+    // written aside and renamed, a crash while saving leaves the last snapshot whole
+    const string tmp_path = path + ".tmp";
+    {
+        ofstream file(tmp_path, ios::binary | ios::trunc);
+        if (!file || !snapshot.SerializeToOstream(&file) || !file.flush()) {
+            LOG(ERROR) << "failed to write parameter snapshot: " << tmp_path;
+            return false;
+        }
+    }
+    if (rename(tmp_path.c_str(), path.c_str()) != 0) {
+        LOG(ERROR) << "failed to replace parameter snapshot: " << path << ", " << strerror(errno);
+        return false;
+    }
+    return true;
+}
+
+bool ParamRPCServerImpl::load(const string& path) {
+    ParamSnapshot snapshot;
+    int fd = open(path.c_str(), O_RDONLY);
+    if (fd < 0) {
+        LOG(WARNING) << "no parameter snapshot: " << path;
+        return false;
+    }
+    struct stat st;
+    bool parsed = false;
+    if (fstat(fd, &st) != 0) parsed = false;
+    else if (st.st_size == 0) parsed = true;    // a node with no parameters
+    else {
+        // parsed straight from the page cache, no copy of the file into a buffer
+        void* data = mmap(nullptr, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+        if (data != MAP_FAILED) {
+            parsed = snapshot.ParseFromArray(data, st.st_size);
+            munmap(data, st.st_size);
+        }
+    }
+    close(fd);
+    if (!parsed) {
+        LOG(ERROR) << "failed to read parameter snapshot: " << path;
+        return false;
+    }
+    vector<string> changed;
+    {
+        unique_lock<shared_mutex> lock(params_mtx);
+        for (auto &entry: snapshot.params()) {
+            const string& name = entry.name();
+            param_entry* param = find_entry(name);
+            if (!param) {
+                // served as it is until declared, so remote nodes find it as soon as this node registers
+                param = &entries.emplace_back();
+                param->name = name;
+                param->type = type_of(entry.payload());
+                param->value = make_unique<SnapshotParameter>(entry.payload());
+                param->is_const = entry.is_const();
+                param->version = max<int64_t>(entry.version(), 1);
+                params[name] = param;
+            } else if (check_set(param, entry.payload()) != ParameterStatus::NORMAL) {
+                LOG(WARNING) << "parameter: " << name << " is a constant or not a " << type_of(entry.payload()) << ", the snapshot value is ignored";
+                continue;
+            } else {
+                param->value->setRemoteValue(entry.payload());
+                param->version++;
+            }
+            changed.push_back(name);
+        }
+    }
+    cv.notify_all();
+    for (auto &name: changed) notify_watchers(name);
+    LOG(INFO) << "loaded " << changed.size() << " parameters from " << path;
+    return true;
+}
+
 bool ParamRPCServerImpl::find_param(const string& name) {
     shared_lock<shared_mutex> lock(params_mtx);
     return params.count(name);
 }
 
-bool ParamRPCServerImpl::is_const(const string& name) {
-    shared_lock<shared_mutex> lock(is_const_params_mtx);
-    return is_const_params.count(name);
+int ParamRPCServerImpl::version_of(const string& name) {
+    shared_lock<shared_mutex> lock(params_mtx);
+    param_entry* entry = find_entry(name);
+    return entry ? entry->version.load() : 0;
+}
+
+ParamRPCServerImpl::param_entry* ParamRPCServerImpl::find_entry(const string& name) {
+    auto it = params.find(name);
+    return it == params.end() ? nullptr : it->second;
+}
+
+const google::protobuf::Any& ParamRPCServerImpl::packed(param_entry& entry) {
+    // readers share params_mtx, the first one after a change packs for all of them
+    unique_lock<mutex> lock(entry.packed_mtx);
+    const int version = entry.version.load();
+    if (entry.packed_version != version) {
+        entry.packed = entry.value->getRemoteValue();
+        entry.packed_version = version;
+    }
+    return entry.packed;
+}
+
+string ParamRPCServerImpl::type_of(const google::protobuf::Any& payload) {
+    const string& url = payload.type_url();
+    return url.substr(url.rfind('/') + 1);
+}
+
+void ParamRPCServerImpl::add_watcher(const string& name, shared_ptr<param_watcher> watcher) {
+    unique_lock<mutex> lock(watchers_mtx);
+    watchers[name].push_back(move(watcher));
+}
+
+void ParamRPCServerImpl::remove_watcher(const string& name, const shared_ptr<param_watcher>& watcher) {
+    unique_lock<mutex> lock(watchers_mtx);
+    auto it = watchers.find(name);
+    if (it == watchers.end()) return;
+    it->second.erase(remove(it->second.begin(), it->second.end(), watcher), it->second.end());
+    if (it->second.empty()) watchers.erase(it);
+}
+
+void ParamRPCServerImpl::publishEvents(function<void(const ParamEvent&)> publish) {
+    unique_lock<mutex> lock(watchers_mtx);
+    event_publish = publish;
+}
+
+void ParamRPCServerImpl::publish_event(const string& name) {
+    ParamEvent event;
+    event.set_name(name);
+    {
+        shared_lock<shared_mutex> lock(params_mtx);
+        param_entry* entry = find_entry(name);
+        if (!entry) return;
+        event.set_version(entry->version.load());
+        event.mutable_payload()->CopyFrom(packed(*entry));
+    }
+    function<void(const ParamEvent&)> publish;
+    {
+        unique_lock<mutex> lock(watchers_mtx);
+        publish = event_publish;
+    }
+    if (publish) publish(event);
+}
+
+void ParamRPCServerImpl::notify_watchers(const string& name) {
+    unique_lock<mutex> lock(watchers_mtx);
+    if (event_publish) {
+        // merged like the callbacks, a burst of changes is one event with the latest version
+        auto &watcher = event_watchers[name];
+        if (!watcher) {
+            watcher = make_shared<param_watcher>();
+            watcher->notify = [this, name]() {publish_event(name);};
+        }
+        notify(watcher);
+    }
+    auto it = watchers.find(name);
+    if (it == watchers.end()) return;
+    for (auto &watcher: it->second) notify(watcher);
+}
+
+void ParamRPCServerImpl::notify(const shared_ptr<param_watcher>& watcher) {
+    if (watcher->pending.exchange(true)) return;
+    dispatcher.post([watcher]() {
+        // cleared first, a change while the callback runs queues it again
+        watcher->pending = false;
+        watcher->notify();
+    });
 }
 
-void ParamSlot::get(getParamRPCReply& reply) {
+bool ParamSlot::get(getParamRPCReply& reply, int64_t* version) {
+    unique_lock<mutex> lock(mtx);
+    if (version && *version == version_ && data.status() == ParameterStatus::NORMAL) return false;
     reply = data;
+    if (version) *version = version_;
+    return true;
 }
 void ParamSlot::set(const getParamRPCReply& reply) {
-    data = reply;
+    // numbered across all slots, a copy from a reconnected peer never takes the version of an older one
+    static atomic<int64_t> sequence {0};
+    {
+        unique_lock<mutex> lock(mtx);
+        data = reply;
+        version_ = ++sequence;
+    }
+    cv.notify_all();
+}
+bool ParamSlot::wait_until(const chrono::steady_clock::time_point& deadline) {
+    unique_lock<mutex> lock(mtx);
+    return cv.wait_until(lock, deadline, [this]() {return data.status() == ParameterStatus::NORMAL || !core::ok();});
 }
 
 void DynamicParamSlot::set(const getParamRPCReply& reply) {
-    data = reply;
-    if (data.status() == ParameterStatus::NORMAL) {
-        thread([this, reply](){
+    ParamSlot::set(reply);
+    if (reply.status() == ParameterStatus::NORMAL) {
+        dispatcher->post([cb = cb, reply](){
             cb(reply);
-        }).detach();
+        });
     }
 }
 
-void DynamicParamSlot::get(getParamRPCReply& reply) {
-    reply = data;
-}
-
-ParamRPCClient::ParamRPCClient(shared_ptr<Channel> channel): stub_(ParamRPC::NewStub(channel)) {}
+ParamRPCClient::ParamRPCClient(shared_ptr<Channel> channel, shared_ptr<WorkerPool> dispatcher_): stub_(ParamRPC::NewStub(channel)), dispatcher(dispatcher_) {}
 
 ParamRPCClient::~ParamRPCClient() {
-    unique_lock<shared_mutex> lock(write_thread_mtx);
-    while (!write_thread.empty()) {
-        write_thread.front().join();
-        write_thread.pop();
+    {
+        unique_lock<mutex> lock(watch_mtx);
+        if (watch_context) watch_context->TryCancel();
     }
+    if (watch_thread.joinable()) watch_thread.join();
 }
 
 bool ParamRPCClient::find_param(const string& name) {
@@ -84,6 +402,17 @@ bool ParamRPCClient::find_param(const string& name) {
     return get_replies.count(name);
 }
 
+ParamBatchReply ParamRPCClient::batchRemoteParams(const ParamBatchRequest& request) {
+    ClientContext context;
+    ParamBatchReply reply;
+    Status status = stub_->batchRemoteParams(&context, request, &reply);
+    if (!status.ok()) {
+        reply.Clear();
+        reply.set_status(ParameterStatus::TMEP_NOT_AVALIABLE);
+    }
+    return reply;
+}
+
 setParamRPCReply ParamRPCClient::setRemoteParam(const setParamRPCRequest& request) {
     ClientContext context;
     setParamRPCReply reply;
@@ -96,34 +425,94 @@ setParamRPCReply ParamRPCClient::setRemoteParam(const setParamRPCRequest& reques
 
 void ParamRPCClient::getRemoteParam(const getParamRPCRequest& request, getParamRPCReply& reply, function<void(const getParamRPCReply)> cb) {
     reply.set_status(ParameterStatus::TMEP_NOT_AVALIABLE);
-    if (find_param(request.name())) {
+    if (!cb) {
+        slot(request.name())->get(reply);
+        return;
+    }
+    unique_lock<shared_mutex> lock(get_replies_mtx);
+    const bool watching = get_replies.count(request.name());
+    get_replies[request.name()] = make_shared<DynamicParamSlot>(cb, dispatcher);
+    lock.unlock();
+    if (watching) {
+        // a new slot starts empty, the server sends the value again
+        ParamWatchRequest unwatch;
+        unwatch.add_remove(request.name());
+        write_watch(unwatch);
+    }
+    ParamWatchRequest watch;
+    watch.add_add(request.name());
+    write_watch(watch);
+}
+
+ParameterStatus ParamRPCClient::getRemoteParam(const string& name, getParamRPCReply& reply,
+    const chrono::steady_clock::time_point& deadline, int64_t* version) {
+    shared_ptr<ParamSlot> slot_ = slot(name);
+    slot_->wait_until(deadline);
+    if (!slot_->get(reply, version)) return ParameterStatus::NORMAL;    // unchanged since version
+    return reply.status();
+}
+
+shared_ptr<ParamSlot> ParamRPCClient::slot(const string& name) {
+    {
         shared_lock<shared_mutex> lock(get_replies_mtx);
-        if (cb) get_replies[request.name()] = static_cast<ParamSlot*>( new DynamicParamSlot(cb) );
-        return get_replies[request.name()]->get(reply);
+        auto it = get_replies.find(name);
+        if (it != get_replies.end()) return it->second;
     }
     unique_lock<shared_mutex> lock(get_replies_mtx);
-    if (cb) get_replies[request.name()] = static_cast<ParamSlot*>( new DynamicParamSlot(cb) );
-    else get_replies[request.name()] = new ParamSlot();
+    auto it = get_replies.find(name);
+    if (it != get_replies.end()) return it->second;
+    auto slot_ = make_shared<ParamSlot>();
+    get_replies[name] = slot_;
     lock.unlock();
-    unique_lock<shared_mutex> thread_lock(write_thread_mtx);
-    write_thread.push(
-        thread( [this, request](){
-        ClientContext context;
-        getParamRPCReply response;
-        unique_ptr<ClientReader<getParamRPCReply>> reader = stub_->getRemoteParam(&context, request);
-        while (reader->Read(&response)) {
-            unique_lock<shared_mutex> lock(get_replies_mtx);
-            get_replies[request.name()]->set(response);
+    ParamWatchRequest watch;
+    watch.add_add(name);
+    write_watch(watch);
+    return slot_;
+}
+
+void ParamRPCClient::unwatchRemoteParam(const string& name) {
+    {
+        unique_lock<shared_mutex> lock(get_replies_mtx);
+        auto it = get_replies.find(name);
+        if (it == get_replies.end()) return;
+        get_replies.erase(it);
+    }
+    ParamWatchRequest watch;
+    watch.add_remove(name);
+    write_watch(watch);
+}
+
+void ParamRPCClient::write_watch(const ParamWatchRequest& request) {
+    unique_lock<mutex> lock(watch_mtx);
+    if (!watch_stream) {
+        watch_context = make_unique<ClientContext>();
+        watch_stream = stub_->watchRemoteParams(watch_context.get());
+        watch_thread = thread(&ParamRPCClient::read_updates, this);
+    }
+    watch_stream->Write(request);
+}
+
+void ParamRPCClient::read_updates() {
+    ParamWatchUpdate update;
+    while (watch_stream->Read(&update)) {
+        shared_lock<shared_mutex> lock(get_replies_mtx);
+        for (auto &delta: update.deltas()) {
+            auto it = get_replies.find(delta.name());
+            if (it == get_replies.end()) continue;
+            getParamRPCReply reply;
+            reply.set_status(delta.status());
+            reply.mutable_payload()->CopyFrom(delta.payload());
+            it->second->set(reply);
         }
-        })
-    );
+    }
 }
 
-ParamRPCClientClub::ParamRPCClientClub() {}
+ParamRPCClientClub::ParamRPCClientClub() : dispatcher(make_shared<WorkerPool>(1)) {}
 
 void ParamRPCClientClub::add_client(const string& namespace_, const string& srv_addr) {
     unique_lock<shared_mutex> lock(mtx);
-    clients[namespace_] = make_unique<ParamRPCClient>( CreateChannel(srv_addr, grpc::InsecureChannelCredentials()) );
+    clients[namespace_] = make_shared<ParamRPCClient>( CreateChannel(srv_addr, grpc::InsecureChannelCredentials()), dispatcher );
+    clients_cv.notify_all();
     auto req_pack_queue = get_requests_queue[namespace_];
     while (!req_pack_queue.empty()) {
         auto req_pack = req_pack_queue.front();
@@ -133,6 +522,62 @@ void ParamRPCClientClub::add_client(const string& namespace_, const string& srv_
     }
 }
 
+void ParamRPCClientClub::unwatchRemoteRequest(const string& name, const string& namespace_) {
+    unique_lock<shared_mutex> lock(mtx);
+    auto &req_pack_queue = get_requests_queue[namespace_];
+    queue<getRequestPack> kept;
+    while (!req_pack_queue.empty()) {
+        if (req_pack_queue.front().req.name() != name) kept.push(req_pack_queue.front());
+        req_pack_queue.pop();
+    }
+    req_pack_queue.swap(kept);
+    if (clients.count(namespace_)) clients[namespace_]->unwatchRemoteParam(name);
+}
+
+ParamBatchReply ParamRPCClientClub::batchRemoteRequest(const ParamBatchRequest& request, const string& namespace_) {
+    shared_lock<shared_mutex> lock(mtx);
+    ParamBatchReply reply;
+    reply.set_status(ParameterStatus::TMEP_NOT_AVALIABLE);
+    auto it = clients.find(namespace_);
+    if (it == clients.end()) return reply;
+    return it->second->batchRemoteParams(request);
+}
+
+ParamBatch& ParamBatch::get(const string& name) {
+    request_.add_get(name);
+    return *this;
+}
+
+ParamBatch& ParamBatch::setAtomic(const bool atomic) {
+    request_.set_atomic(atomic);
+    return *this;
+}
+
+ParamBatchResult::ParamBatchResult(ParamBatchReply reply) : reply_(move(reply)) {
+    for (int i = 0; i < reply_.got_size(); i++) got_index[reply_.got(i).name()] = i;
+    for (int i = 0; i < reply_.set_size(); i++) set_index[reply_.set(i).name()] = i;
+}
+
+vector<string> ParamBatchResult::names() const {
+    vector<string> names;
+    for (auto &got: reply_.got()) names.push_back(got.name());
+    return names;
+}
+
+ParameterStatus ParamBatchResult::setStatus(const string& name, int64_t* version) const {
+    auto it = set_index.find(name);
+    if (it == set_index.end()) return ParameterStatus::TMEP_NOT_AVALIABLE;
+    if (version) *version = reply_.set(it->second).version();
+    return reply_.set(it->second).status();
+}
+
+shared_ptr<ParamRPCClient> ParamRPCClientClub::client(const string& namespace_, const chrono::steady_clock::time_point& deadline) {
+    shared_lock<shared_mutex> lock(mtx);
+    clients_cv.wait_until(lock, deadline, [&]() {return clients.count(namespace_) || !core::ok();});
+    auto it = clients.find(namespace_);
+    return it == clients.end() ? nullptr : it->second;
+}
+
 void ParamRPCClientClub::delete_client(const string& namespace_) {
     unique_lock<shared_mutex> lock(mtx);
     clients.erase(namespace_);
@@ -1,11 +1,58 @@
 #include "TCPClient.hpp"
 #include "rscl.hpp"
+#include <sys/uio.h>
+#include <climits>
+#include <algorithm>
+#ifdef __linux__
+#include <sys/eventfd.h>
+#include <linux/errqueue.h>
+#endif
 namespace core {
-TCPClient::TCPClient() {
-    clients_data = vector<string>(100, "");
+topic_writer::~topic_writer() {
+    delete routes.load();
+}
+
+bool topic_writer::has_subscribers() const {
+    read_guard guard(*this);
+    return !guard.list->empty();
+}
+
+void topic_writer::update(const route_list* next) {
+    const route_list* replaced = routes.exchange(next);
+    // readers counted in the new phase can only see the new list, those of the old one leave after a few pushes
+    const int old_phase = phase.load();
+    phase.store(1 - old_phase);
+    while (readers[old_phase].load() != 0) this_thread::yield();
+    delete replaced;
+}
+
+TCPClient::TCPClient(const size_t zerocopy_threshold_) : zerocopy_threshold(zerocopy_threshold_) {
+    running = true;
+#ifdef __linux__
+    init_epoll();
+    wake_fd[0] = eventfd(0, EFD_NONBLOCK);
+    wake_fd[1] = -1;
+    add_epoll_event(wake_fd[0], EPOLLIN);
+#elif __APPLE__
+    init_kqueue();
+    if (pipe(wake_fd) < 0) LOG(ERROR) << "Failed to create wake up pipe: " << errno;
+    set_nonblock(wake_fd[0]);
+    set_nonblock(wake_fd[1]);
+    add_kqueue_event(wake_fd[0], EVFILT_READ, EV_ADD | EV_ENABLE);
+#endif
+    io_thread = thread(&TCPClient::io_loop, this);
     LOG(INFO) << "Create client club";
 }
 
+TCPClient::~TCPClient() {
+    running = false;
+    wake();
+    io_thread.join();
+    for (auto &fd_session: fd_sessions) close(fd_session.first);
+    close(wake_fd[0]);
+    if (wake_fd[1] >= 0) close(wake_fd[1]);
+}
+
 void TCPClient::close_and_delete_event(const int& fd) {
     close(fd);
     return;
@@ -33,103 +80,465 @@ bool TCPClient::write_to_cache(const string& topic, const string& data) {
     return static_topic_cache[topic].insert(data).second;
 }
 
-client_info TCPClient::add_client(const string& topic, const string& ip, const int& port) {
+shared_ptr<topic_writer> TCPClient::get_writer(const string& topic) {
+    unique_lock<shared_mutex> lock(mtx);
+    return writer_of(topic);
+}
+
+shared_ptr<topic_writer> TCPClient::writer_of(const string& topic) {
+    auto& writer = writers[topic];
+    if (!writer) writer = make_shared<topic_writer>();
+    return writer;
+}
+
+void TCPClient::set_high_priority_topic(const string& topic) {
+    unique_lock<shared_mutex> lock(mtx);
+    writer_of(topic)->high_priority = true;
+}
+
+client_info TCPClient::add_client(const string& topic, const string& ip, const int& port, bool multiplex, bool high_priority) {
+    /*
+    all topics subscribed by the same tcp server share one session per priority lane if multiplexed,
+    each topic is a channel of it, only the first topic pays for the handshake.
+    otherwise every topic gets a dedicated session.
+    */
     unique_lock<shared_mutex> lock(mtx);
+    high_priority = high_priority || writer_of(topic)->high_priority;
+    const string key = ip + ":" + to_string(port) + (high_priority? "#high": "");
+    client_info info;
+    info.high_priority = high_priority;
+    shared_ptr<session_info> session;
+    if (multiplex && sessions.count(key)) {
+        session = sessions[key];
+    } else {
+        session = make_shared<session_info>();
+        session->multiplex = multiplex;
+        session->high_priority = high_priority;
+        session->key = key;
+        if (!connect_session(session, ip, port)) {
+            promise<bool> failed;
+            failed.set_value(false);
+            info.connected = failed.get_future();
+            return info;
+        }
+        if (multiplex) sessions[key] = session;
+    }
+    open_channel(session, topic);
+    const uint32_t channel = session->channels[topic];
+    info.ip = session->local_ip;
+    info.port = session->local_port;
+    info.channel = channel;
+    shared_future<bool> ready = session->ready;
+    info.connected = async(launch::deferred, [ready]() { return ready.get(); });
+    if (session->connected.load()) {
+        bool subscribed = add_route(topic, session, channel);
+        lock.unlock();
+        schedule(session);
+        if (subscribed) notify_subscription(topic, true);
+    }
+    return info;
+}
+
+bool TCPClient::connect_session(shared_ptr<session_info> session, const string& ip, const int& port) {
     int fd = create_socket();
-    if (fd < 0) return client_info{};
+    if (fd < 0) return false;
+    if (session->high_priority) set_high_priority(fd);
+    if (zerocopy_threshold > 0) session->zerocopy = set_zerocopy(fd) == 0;
     struct sockaddr_in dest;
     bzero(&dest, sizeof(dest));
     dest.sin_family = AF_INET;
     dest.sin_port = htons(port);
-    promise<bool> promise;
-    client_info info;
-    info.connected = promise.get_future();
-    if ( inet_pton(AF_INET, ip.c_str(), &dest.sin_addr.s_addr) == 0 ) {
+    if ( inet_pton(AF_INET, ip.c_str(), &dest.sin_addr.s_addr) == 0 || 
+    (connect(fd, (struct sockaddr*)&dest, sizeof(dest)) < 0 && errno != EINPROGRESS) ) {
         close_and_delete_event(fd);
-        promise.set_value(false);
-        return info;
+        return false;
     }
-    if (connect(fd, (struct sockaddr*)&dest, sizeof(dest)) < 0 ) {
-        if(errno != EINPROGRESS) {
+    if (!get_socket_info(fd, session->local_ip, session->local_port)) return false;
+    session->fd = fd;
+    auto connected = make_shared<promise<bool>>();
+    session->ready = connected->get_future().share();
+    thread([this, fd, session, connected]() {
+        fd_set write_fds;
+        FD_ZERO(&write_fds);
+        FD_SET(fd, &write_fds);
+        int err = -1;
+        socklen_t len = sizeof(err);
+        bool ok = select(fd + 1, nullptr, &write_fds, nullptr, nullptr) > 0 && 
+            getsockopt(fd, SOL_SOCKET, SO_ERROR, &err, &len) == 0 && err == 0;
+        unique_lock<shared_mutex> lock(this->mtx);
+        if (!ok) {
+            // never routed, so the io thread has not seen this session yet
+            session->closing = true;
+            auto it = sessions.find(session->key);
+            if (it != sessions.end() && it->second == session) sessions.erase(it);
             close_and_delete_event(fd);
-            promise.set_value(false);
-            return info;
-        } else {
-            string src_ip;
-            int src_port;
-            if (!get_socket_info(fd, src_ip, src_port)) {
-                close_and_delete_event(fd);
-                promise.set_value(false);
-                return info;
-            } else {
-                info.ip = src_ip;
-                info.port = src_port;
+            session->fd = -1;
+            connected->set_value(false);
+            return;
+        }
+        session->connected = true;
+        fd_sessions[fd] = session;
+    #ifdef __linux__
+        add_epoll_event(fd, EPOLLOUT | EPOLLET);
+    #elif __APPLE__
+        add_kqueue_event(fd, EVFILT_WRITE, EV_ADD | EV_CLEAR);
+    #endif
+        vector<string> topics;
+        for (auto &channel: session->channels) {
+            if (add_route(channel.first, session, channel.second)) topics.push_back(channel.first);
+        }
+        connected->set_value(true);
+        lock.unlock();
+        schedule(session);
+        for (auto &topic: topics) notify_subscription(topic, true);
+    }).detach();
+    return true;
+}
+
+void TCPClient::open_channel(shared_ptr<session_info> session, const string& topic) {
+    if (session->channels.count(topic)) return;
+    const uint32_t channel = session->multiplex? session->next_channel++: 0;
+    session->channels[topic] = channel;
+    if (session->multiplex) session->inbox.push({channel, make_shared<const string>(topic), true});
+    if (static_topic_cache.count(topic)) {
+        for (auto &s: static_topic_cache[topic]) {
+            session->inbox.push({channel, make_shared<const string>(s), false});
+        }
+    }
+}
+
+bool TCPClient::add_route(const string& topic, shared_ptr<session_info> session, const uint32_t channel) {
+    auto writer = writer_of(topic);
+    const topic_writer::route_list* routes = writer->routes.load();
+    for (auto &route: *routes) {
+        if (route.session == session && route.channel == channel) return false;
+    }
+    auto updated = new topic_writer::route_list(*routes);
+    updated->push_back({session, channel});
+    writer->update(updated);
+    return true;
+}
+
+vector<string> TCPClient::drop_session(shared_ptr<session_info> session) {
+    // detach a session from every topic, the io thread closes its socket afterwards.
+    vector<string> lost_topics;
+    if (session->closing.exchange(true)) return lost_topics;
+    for (auto &channel: session->channels) {
+        auto writer = writer_of(channel.first);
+        const topic_writer::route_list* routes = writer->routes.load();
+        auto updated = new topic_writer::route_list();
+        for (auto &route: *routes) {
+            if (route.session != session) updated->push_back(route);
+        }
+        if (updated->size() == routes->size()) {
+            delete updated;
+            continue;
+        }
+        writer->update(updated);
+        lost_topics.push_back(channel.first);
+    }
+    auto fd_it = fd_sessions.find(session->fd);
+    if (fd_it != fd_sessions.end() && fd_it->second == session) fd_sessions.erase(fd_it);
+    auto it = sessions.find(session->key);
+    if (it != sessions.end() && it->second == session) sessions.erase(it);
+    return lost_topics;
+}
+
+void TCPClient::write_to_socket(const shared_ptr<topic_writer>& writer, string msg) {
+    /*
+    publishers never take mtx: the message is shared by every route and handed
+    to the session inbox, the io thread does the actual write.
+    the shared payload and one inbox node per route are still allocated here.
+    */
+    topic_writer::read_guard guard(*writer);
+    if (guard.list->empty()) return;
+    auto payload = make_shared<const string>(move(msg));
+    for (auto &route: *guard.list) {
+        route.session->inbox.push({route.channel, payload, false});
+        schedule(route.session);
+    }
+}
+
+void TCPClient::schedule(const shared_ptr<session_info>& session) {
+    if (session->scheduled.exchange(true)) return;
+    if (session->high_priority) ready_high_priority.push(session);
+    else ready_normal_priority.push(session);
+    if (this_thread::get_id() != io_thread.get_id()) wake();
+}
+
+void TCPClient::wake() {
+#ifdef __linux__
+    uint64_t one = 1;
+    if (write(wake_fd[0], &one, sizeof(one)) < 0 && errno != EAGAIN) LOG(ERROR) << "Failed to wake up client club: " << errno;
+#elif __APPLE__
+    char one = 1;
+    if (write(wake_fd[1], &one, sizeof(one)) < 0 && errno != EAGAIN) LOG(ERROR) << "Failed to wake up client club: " << errno;
+#endif
+}
+
+void TCPClient::io_loop() {
+    int event_ret;
+    int fd;
+    while (running.load()) {
+    #ifdef __linux__
+        event_ret = epoll_wait(epoll_fd, events, maxevents, -1);
+    #elif __APPLE__
+        event_ret = kevent(kq_fd, NULL, 0, events, maxevents, NULL);
+    #endif
+        if (event_ret < 0 && errno != EINTR) LOG(ERROR) << "Failed to wait for event: " << errno;
+        for (int i = 0; i < event_ret; i++) {
+        #ifdef __linux__
+            fd = events[i].data.fd;
+        #elif __APPLE__
+            fd = events[i].ident;
+        #endif
+            if (fd == wake_fd[0]) {
+                char buf[64];
+                while (read(wake_fd[0], buf, sizeof(buf)) > 0) {}
+                continue;
+            }
+            // the socket buffer has room again
+            shared_ptr<session_info> session;
+            {
+                shared_lock<shared_mutex> lock(mtx);
+                auto it = fd_sessions.find(fd);
+                if (it != fd_sessions.end()) session = it->second;
             }
-            thread([fd, promise = std::move(promise), this, topic]() mutable {
-                fd_set write_fds;
-                FD_ZERO(&write_fds);
-                FD_SET(fd, &write_fds);
-                int err;
-                socklen_t len = sizeof(err);
-                if (select(fd + 1, nullptr, &write_fds, nullptr, nullptr) > 0) {
-                    if (getsockopt(fd, SOL_SOCKET, SO_ERROR, &err, &len) < 0) promise.set_value(false);
-                    else {
-                        if (err == 0) {
-                            clients_topic_fd[topic].insert(fd);
-                            if (clients_data.size() <= fd) clients_data.resize(clients_data.size() + 100);
-                            string data_init = "";
-                            if (static_topic_cache.count(topic)) {
-                                for (auto s: static_topic_cache[topic]) {
-                                    data_init.append(s.data(), s.length());
-                                }
-                            }
-                            clients_data[fd] = data_init;
-                            promise.set_value(true);
-                            unique_lock<shared_mutex> lock(this->mtx);
-                            this->write_fd(topic, fd);
-                        } else {
-                            close_and_delete_event(fd);
-                            promise.set_value(false);
-                        }
-                    }
-                } else {
-                    close_and_delete_event(fd);
-                    promise.set_value(false);
-                }
-            }).detach();
+            if (session) schedule(session);
         }
+        // every ready high priority session is served before the next normal one
+        shared_ptr<session_info> session;
+        while (ready_high_priority.pop(session) || ready_normal_priority.pop(session)) flush(session);
     }
-    return info;
 }
 
-void TCPClient::write_to_socket(const string& topic, const string& msg, const int& timeout) {
-    unique_lock<shared_mutex> lock(mtx);
-    for (auto fd: clients_topic_fd[topic]) {
-        if (clients_data[fd].length() > MAX_WRITE_BUFFER_SIZE) continue;
-        clients_data[fd].append(msg.data(), msg.length());
-        if (!write_fd(topic, fd)) return;
-    }
-}
-
-bool TCPClient::write_fd(const string& topic, const int& fd) {
-    const string to_send = clients_data[fd];
-    int n = to_send.length(); int siz = n;
-    int nwrite = 0;
-    while (n > 0) {
-        nwrite = write(fd, to_send.data() + siz - n, n);
-        if (nwrite < n) {
-            if (nwrite == -1 && errno != EAGAIN) {
-                LOG(ERROR) << "Failed to write to socket";
-                clients_topic_fd[topic].erase(fd);
-                clients_data[fd] = "";
-                close_and_delete_event(fd);
-                return false;
+void TCPClient::flush(const shared_ptr<session_info>& session) {
+    session->scheduled = false;
+    if (session->closing.load()) {
+        if (session->fd >= 0) {
+        #ifdef __linux__
+            delete_epoll_event(session->fd);
+        #endif
+            close_and_delete_event(session->fd);
+            session->fd = -1;
+        }
+        return;
+    }
+    if (!session->zerocopy_inflight.empty()) reap_zerocopy(*session);
+    session_info::outgoing item;
+    while (session->inbox.pop(item)) stage(*session, move(item));
+    if (!session->connected.load() || write_session(*session)) return;
+    LOG(ERROR) << "Failed to write to socket";
+    vector<string> lost_topics;
+    {
+        unique_lock<shared_mutex> lock(mtx);
+        lost_topics = drop_session(session);
+    }
+    flush(session);
+    for (auto &topic: lost_topics) notify_subscription(topic, false);
+}
+
+void TCPClient::stage(session_info& session, session_info::outgoing item) {
+    // a subscriber that cannot keep up loses new messages instead of growing the queue
+    if (!item.open && session.pending_bytes[item.channel] > MAX_WRITE_BUFFER_SIZE) return;
+    const size_t size = item.payload->size();
+    const bool zerocopy = !item.open && zerocopy_threshold > 0 && size >= zerocopy_threshold;
+    // chunks of a large message leave room for the other channels of a session in between
+    const size_t chunk_size = session.multiplex && !item.open? LARGE_MESSAGE_CHUNK_SIZE: size;
+    size_t begin = 0;
+    do {
+        session_info::frame frame;
+        frame.payload = item.payload;
+        frame.begin = begin;
+        frame.length = min(chunk_size, size - begin);
+        frame.zerocopy = zerocopy;
+        begin += frame.length;
+        if (session.multiplex) frame.header = mux_header(item.channel, frame.length, item.open, begin < size);
+        session.pending_bytes[item.channel] += frame.size();
+        session.pending[item.channel].push_back(move(frame));
+    } while (begin < size);
+}
+
+bool TCPClient::write_session(session_info& session) {
+    /*
+    frames of different channels are interleaved round robin in one writev,
+    the starting channel rotates every call so no topic is always served first.
+    */
+    while (true) {
+        vector<uint32_t> order;
+        for (auto &channel: session.pending) {
+            if (!channel.second.empty()) order.push_back(channel.first);
+        }
+        if (order.empty()) return true;
+        rotate(order.begin(), order.begin() + (session.round_robin++ % order.size()), order.end());
+
+        const size_t max_slots = IOV_MAX / 2; // header and payload of a frame are separate io vectors
+        vector<pair<uint32_t, size_t>> slots; // channel, index of frame in its queue
+        if (session.head_channel >= 0) slots.push_back({session.head_channel, 0});
+        for (size_t round = 0; slots.size() < max_slots; round++) {
+            bool any = false;
+            for (auto channel: order) {
+                size_t index = round + (channel == session.head_channel? 1: 0);
+                if (index >= session.pending[channel].size()) continue;
+                slots.push_back({channel, index});
+                any = true;
+                if (slots.size() >= max_slots) break;
+            }
+            if (!any) break;
+        }
+        /*
+        a zerocopy payload is sent alone, at most one chunk per call, so the pinned
+        pages of a send belong to one payload. its header goes with the copied frames before it.
+        */
+        vector<struct iovec> iov;
+        vector<size_t> spans; // bytes of each slot in this write
+        size_t total = 0;
+        shared_ptr<const string> zerocopy_payload;
+        for (auto &slot: slots) {
+            session_info::frame& frame = session.pending[slot.first][slot.second];
+            const size_t header_size = frame.header.size();
+            const size_t header_left = frame.offset < header_size? header_size - frame.offset: 0;
+            const size_t payload_offset = frame.offset > header_size? frame.offset - header_size: 0;
+            char* payload = const_cast<char*>(frame.payload->data()) + frame.begin + payload_offset;
+            size_t payload_left = frame.length - payload_offset;
+            const bool zerocopy = frame.zerocopy && session.zerocopy;
+            if (zerocopy && header_left == 0) {
+                if (!iov.empty()) break;
+                payload_left = min(payload_left, (size_t)LARGE_MESSAGE_CHUNK_SIZE);
+                iov.push_back({payload, payload_left});
+                spans.push_back(payload_left);
+                total += payload_left;
+                zerocopy_payload = frame.payload;
+                break;
             }
-            else if (errno == EAGAIN) break;
+            if (header_left > 0) iov.push_back({&frame.header[frame.offset], header_left});
+            if (!zerocopy && payload_left > 0) iov.push_back({payload, payload_left});
+            const size_t span = header_left + (zerocopy? 0: payload_left);
+            spans.push_back(span);
+            total += span;
+            if (zerocopy) break;
         }
-        n -= nwrite;
+        ssize_t nwrite = zerocopy_payload? send_zerocopy(session, iov[0], zerocopy_payload): writev(session.fd, iov.data(), iov.size());
+        if (nwrite < 0) return errno == EAGAIN || errno == EWOULDBLOCK;
+        size_t remain = nwrite;
+        map<uint32_t, size_t> written;
+        session.head_channel = -1;
+        for (size_t i = 0; i < spans.size(); i++) {
+            session_info::frame& frame = session.pending[slots[i].first][slots[i].second];
+            const size_t step = min(remain, spans[i]);
+            frame.offset += step;
+            remain -= step;
+            if (frame.offset == frame.size()) {
+                written[slots[i].first]++;
+                continue;
+            }
+            if (frame.offset > 0) session.head_channel = slots[i].first;
+            break;
+        }
+        for (auto &w: written) {
+            auto& queue = session.pending[w.first];
+            for (size_t i = 0; i < w.second; i++) {
+                session.pending_bytes[w.first] -= queue.front().size();
+                queue.pop_front();
+            }
+        }
+        if (nwrite < total) return true;
     }
-    clients_data[fd].erase(0, siz - n);
-    return true;
 }
-}
\ No newline at end of file
+
+ssize_t TCPClient::send_zerocopy(session_info& session, const struct iovec& iov, const shared_ptr<const string>& payload) {
+#if defined(__linux__) && defined(MSG_ZEROCOPY)
+    struct msghdr msg;
+    memset(&msg, 0, sizeof(msg));
+    msg.msg_iov = const_cast<struct iovec*>(&iov);
+    msg.msg_iovlen = 1;
+    ssize_t ret = sendmsg(session.fd, &msg, MSG_ZEROCOPY);
+    if (ret >= 0) {
+        // the kernel numbers every zerocopy send, the payload must outlive its completion
+        session.zerocopy_inflight.push_back({session.zerocopy_seq++, payload});
+        return ret;
+    }
+    if (errno != ENOBUFS) return ret;
+    // out of memory to pin pages, this chunk is copied instead
+#endif
+    return writev(session.fd, &iov, 1);
+}
+
+void TCPClient::reap_zerocopy(session_info& session) {
+#if defined(__linux__) && defined(MSG_ZEROCOPY)
+    while (!session.zerocopy_inflight.empty()) {
+        char control[128];
+        struct msghdr msg;
+        memset(&msg, 0, sizeof(msg));
+        msg.msg_control = control;
+        msg.msg_controllen = sizeof(control);
+        if (recvmsg(session.fd, &msg, MSG_ERRQUEUE | MSG_DONTWAIT) < 0) return;
+        for (struct cmsghdr* cm = CMSG_FIRSTHDR(&msg); cm; cm = CMSG_NXTHDR(&msg, cm)) {
+            if (cm->cmsg_level != SOL_IP || cm->cmsg_type != IP_RECVERR) continue;
+            const struct sock_extended_err* err = reinterpret_cast<const struct sock_extended_err*>(CMSG_DATA(cm));
+            if (err->ee_errno != 0 || err->ee_origin != SO_EE_ORIGIN_ZEROCOPY) continue;
+            // the kernel copied anyway (e.g. loopback), zerocopy only adds the completion cost then
+            if (err->ee_code & SO_EE_CODE_ZEROCOPY_COPIED) session.zerocopy = false;
+            // completions of a tcp socket arrive in order, ee_data is the last finished send
+            while (!session.zerocopy_inflight.empty() &&
+            (int32_t)(session.zerocopy_inflight.front().first - err->ee_data) <= 0) {
+                session.zerocopy_inflight.pop_front();
+            }
+        }
+    }
+#endif
+}
+
+int TCPClient::subscriber_count(const string& topic) {
+    /*
+    subscribers never write back on topic sockets, so a readable socket
+    with nothing to read means the peer has closed its side.
+    */
+    unique_lock<shared_mutex> lock(mtx);
+    auto writer = writer_of(topic);
+    vector<shared_ptr<session_info>> closed_sessions;
+    for (auto &route: *writer->routes.load()) {
+        if (is_peer_closed(route.session->fd)) closed_sessions.push_back(route.session);
+    }
+    vector<string> lost_topics;
+    for (auto &session: closed_sessions) {
+        vector<string> closed = drop_session(session);
+        lost_topics.insert(lost_topics.end(), closed.begin(), closed.end());
+    }
+    const int count = writer->routes.load()->size();
+    lock.unlock();
+    for (auto &session: closed_sessions) schedule(session);
+    for (auto &lost_topic: lost_topics) notify_subscription(lost_topic, false);
+    return count;
+}
+
+void TCPClient::add_subscribe_callback(const string& topic, function<void(const int)> cb) {
+    unique_lock<shared_mutex> lock(mtx);
+    subscribe_callbacks[topic].push_back(cb);
+}
+
+void TCPClient::add_unsubscribe_callback(const string& topic, function<void(const int)> cb) {
+    unique_lock<shared_mutex> lock(mtx);
+    unsubscribe_callbacks[topic].push_back(cb);
+}
+
+bool TCPClient::is_peer_closed(const int& fd) {
+    char c;
+    ssize_t ret = recv(fd, &c, 1, MSG_PEEK | MSG_DONTWAIT);
+    if (ret == 0) return true;
+    return ret < 0 && errno != EAGAIN && errno != EWOULDBLOCK;
+}
+
+void TCPClient::notify_subscription(const string& topic, bool subscribed) {
+    // callbacks run without holding mtx, so they are free to publish.
+    shared_lock<shared_mutex> lock(mtx);
+    auto& callbacks = subscribed? subscribe_callbacks: unsubscribe_callbacks;
+    auto cb_it = callbacks.find(topic);
+    if (cb_it == callbacks.end()) return;
+    const vector<function<void(const int)>> to_call = cb_it->second;
+    auto writer_it = writers.find(topic);
+    const int count = writer_it == writers.end()? 0: writer_it->second->routes.load()->size();
+    lock.unlock();
+    for (auto &cb: to_call) cb(count);
+}
+}
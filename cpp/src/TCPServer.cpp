@@ -1,4 +1,5 @@
 #include "TCPServer.hpp"
+#include <algorithm>
 namespace core {
 TCPServer::TCPServer(const string& ip, const int port) : tcp_srv_ip(ip), tcp_srv_port(port) {
     #ifdef __linux__
@@ -9,13 +10,21 @@ TCPServer::TCPServer(const string& ip, const int port) : tcp_srv_ip(ip), tcp_srv
     fd_to_addr.resize(100);
 }
 
-void TCPServer::accept_client(const string& topic, const string& ip, const int &port) {
+void TCPServer::accept_client(const string& topic, const string& ip, const int &port, bool multiplex, bool high_priority) {
     const string token = ip + ":" + to_string(port);
+    unique_lock<shared_mutex> lock(mtx);
+    // further topics of an accepted session announce themselves with a channel open frame
+    if (multiplex && session_addrs.count(token)) return;
     if (unmapped_addr_to_fd.count(token)) {
-        unique_lock<shared_mutex> lock(mtx);
         LOG(INFO) << "accept topic publisher on: " << token;
-        addr_to_topic[token] = topic;
         int fd = unmapped_addr_to_fd[token];
+        if (high_priority) high_priority_fds.insert(fd);
+        if (multiplex) {
+            session_addrs.insert(token);
+            session_channels[fd].clear();
+        } else {
+            addr_to_topic[token] = topic;
+        }
         if (fd_receive_data.size() <= fd) fd_receive_data.resize(fd_receive_data.size() + 100);
         fd_receive_data[fd] = "";
         #ifdef __linux__
@@ -25,8 +34,9 @@ void TCPServer::accept_client(const string& topic, const string& ip, const int &
         #endif
         unmapped_addr_to_fd.erase(token);
     } else {
+        lock.unlock();
         this_thread::sleep_for(chrono::milliseconds(100));
-        accept_client(topic, ip, port);
+        accept_client(topic, ip, port, multiplex, high_priority);
     }
 }
 
@@ -116,6 +126,10 @@ void TCPServer::close_and_delete_event(const int& fd, const int& revents) {
     const string token = fd_to_addr[fd];
     if (unmapped_addr_to_fd.count(token)) unmapped_addr_to_fd.erase(token);
     if (addr_to_topic.count(token)) addr_to_topic.erase(token);
+    session_addrs.erase(token);
+    session_channels.erase(fd);
+    session_messages.erase(fd);
+    high_priority_fds.erase(fd);
     fd_to_addr[fd] = "";
     fd_receive_data[fd] = "";
 #ifdef __linux__
@@ -137,16 +151,20 @@ void TCPServer::handle_client_event(const int& client_fd, const int& revents) {
     #elif __APPLE__
         if (!(revents & EVFILT_READ)) return;
     #endif
+    const bool is_session = session_channels.count(client_fd);
     const string client_addr = fd_to_addr[client_fd];
-    if (!addr_to_topic.count(client_addr)) return;
-    const string topic = addr_to_topic[client_addr];
-    if (!decoders.count(topic)) return;
+    string topic;
+    if (!is_session) {
+        if (!addr_to_topic.count(client_addr)) return;
+        topic = addr_to_topic[client_addr];
+        if (!decoders.count(topic)) return;
+    }
 
     ssize_t recv_ret;
     static size_t buf_size = 8192;
     char buffer_once[buf_size];
     while (true) {
-        recv_ret = recv(client_fd, buffer_once, sizeof(buffer_once), 0);
+        recv_ret = receive(client_fd, is_session, buffer_once, sizeof(buffer_once));
         if (recv_ret == 0) {
             LOG(ERROR) << "Error receiving empty data";
             return close_and_delete_event(client_fd, revents);
@@ -157,14 +175,84 @@ void TCPServer::handle_client_event(const int& client_fd, const int& revents) {
             return close_and_delete_event(client_fd, revents);
         }
         else {
-            fd_receive_data[client_fd].append(buffer_once, recv_ret);
-            int delete_size = decoders[topic]->decode(fd_receive_data[client_fd]);
-            decoders[topic]->handle();
-            fd_receive_data[client_fd].erase(0, delete_size);
+            if (is_session) {
+                decode_session(client_fd);
+            } else {
+                int delete_size = decoders[topic]->decode(fd_receive_data[client_fd]);
+                decoders[topic]->handle();
+                fd_receive_data[client_fd].erase(0, delete_size);
+            }
             buf_size = buf_size == recv_ret? buf_size * 2: buf_size;
             buf_size = buf_size > max_buffer_size? max_buffer_size: buf_size;
+            // a buffer is reused by the next large message, only a very large one is given back
+            string& data = fd_receive_data[client_fd];
+            if (data.capacity() > max_idle_buffer_size && data.size() <= max_buffer_size) data.shrink_to_fit();
+        }
+    }
+}
+
+ssize_t TCPServer::receive(const int& client_fd, const bool is_session, char* buffer, const size_t size) {
+    /*
+    small messages go through the stack buffer, a message or frame larger than max_buffer_size
+    is read straight into fd_receive_data, which is sized for it once instead of growing per read.
+    */
+    string& data = fd_receive_data[client_fd];
+    size_t pending = 0;
+    if (is_session) {
+        uint32_t channel, length;
+        bool open, more;
+        if (read_mux_header(data, 0, channel, length, open, more)) pending = MUX_HEADER_SIZE + length;
+    } else {
+        pending = read_message_size(data.data(), data.size());
+    }
+    if (pending <= max_buffer_size || pending <= data.size()) {
+        ssize_t ret = recv(client_fd, buffer, size, 0);
+        if (ret > 0) data.append(buffer, ret);
+        return ret;
+    }
+    if (data.capacity() < pending) data.reserve(pending);
+    const size_t old_size = data.size();
+    data.resize(min(pending, old_size + max_large_read_size));
+    ssize_t ret = recv(client_fd, &data[old_size], data.size() - old_size, 0);
+    data.resize(old_size + (ret > 0? ret: 0));
+    return ret;
+}
+
+void TCPServer::decode_session(const int& client_fd) {
+    string& data = fd_receive_data[client_fd];
+    auto& channels = session_channels[client_fd];
+    size_t offset = 0;
+    auto& messages = session_messages[client_fd];
+    uint32_t channel, length;
+    bool open, more;
+    while (read_mux_header(data, offset, channel, length, open, more) && 
+    offset + MUX_HEADER_SIZE + length <= data.size()) {
+        const char* payload = data.data() + offset + MUX_HEADER_SIZE;
+        offset += MUX_HEADER_SIZE + length;
+        if (open) {
+            channels[channel] = string(payload, length);
+            LOG(INFO) << "open channel " << channel << " for topic: " << channels[channel] << " on " << fd_to_addr[client_fd];
+            continue;
+        }
+        auto message = messages.find(channel);
+        if (more || message != messages.end()) {
+            // chunks are collected in a buffer reserved from the length prefix of the first one
+            if (message == messages.end()) {
+                message = messages.emplace(channel, string()).first;
+                message->second.reserve(read_message_size(payload, length));
+            }
+            message->second.append(payload, length);
+            if (more) continue;
         }
+        if (channels.count(channel) && decoders.count(channels[channel])) {
+            Decoder* decoder = decoders[channels[channel]];
+            if (message != messages.end()) decoder->decode(message->second);
+            else decoder->decode(payload, length);
+            decoder->handle();
+        }
+        if (message != messages.end()) messages.erase(message);
     }
+    data.erase(0, offset);
 }
 
 int TCPServer::event_handler(int timeout) {
@@ -186,6 +274,16 @@ int TCPServer::event_handler(int timeout) {
     }
 
     unique_lock<shared_mutex> lock(mtx);
+    // high priority connections are served before bulk data arrived in the same wake up
+    if (!high_priority_fds.empty()) {
+        stable_partition(events, events + event_ret, [this](const auto& event) {
+        #ifdef __linux__
+            return high_priority_fds.count(event.data.fd) > 0;
+        #elif __APPLE__
+            return high_priority_fds.count(event.ident) > 0;
+        #endif
+        });
+    }
     for (int i = 0; i < event_ret; i++) {
     #ifdef __linux__
         fd = events[i].data.fd;
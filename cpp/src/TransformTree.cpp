@@ -1,69 +1,144 @@
 #include "rscl.hpp"
 
 namespace core {
-bool TransformTreeNode::TransformEntry::operator<(const TransformEntry& other) const {
-    return transform.header().timestamp().seconds() < other.transform.header().timestamp().seconds() ||
-    (transform.header().timestamp().seconds() == other.transform.header().timestamp().seconds() && 
-    transform.header().timestamp().nanos() < other.transform.header().timestamp().nanos());
+static int64_t to_ns(const google::protobuf::Timestamp& stamp) {
+    return stamp.seconds() * 1000000000LL + stamp.nanos();
 }
 
-KDL::Frame TransformTreeNode::TransformEntry::toKDL() const {
-    const auto& translation = transform.transition();
-    const auto& rotation = transform.rotation();
+KDL::Frame TransformTreeNode::TransformSample::toKDL() const {
     KDL::Frame frame;
-    frame.p = KDL::Vector(translation.x(), translation.y(), translation.z());
-    frame.M = KDL::Rotation::Quaternion(rotation.x(), rotation.y(), rotation.z(), rotation.w());
+    frame.p = KDL::Vector(p[0], p[1], p[2]);
+    frame.M = KDL::Rotation::Quaternion(q[0], q[1], q[2], q[3]);
     return frame;
 }
 
-TransformTreeNode::TransformTreeNode(const string& id, const int memory_duration_ms) :
-frame_id(id), memory_duration(memory_duration_ms) {
+TransformTreeNode::TransformSample TransformTreeNode::TransformSample::interpolate(const TransformSample& a, const TransformSample& b, const int64_t& stamp) {
+    // t out of [0, 1] extrapolates
+    const double t = static_cast<double>(stamp - a.stamp) / (b.stamp - a.stamp);
+    TransformSample sample;
+    sample.stamp = stamp;
+    for (int i = 0; i < 3; i++) sample.p[i] = a.p[i] + (b.p[i] - a.p[i]) * t;
+    double q[4] = {b.q[0], b.q[1], b.q[2], b.q[3]};
+    double dot = a.q[0] * q[0] + a.q[1] * q[1] + a.q[2] * q[2] + a.q[3] * q[3];
+    if (dot < 0) {
+        // the shorter way round
+        for (int i = 0; i < 4; i++) q[i] = -q[i];
+        dot = -dot;
+    }
+    double wa = 1 - t, wb = t;
+    if (dot < 0.9995) {
+        const double theta = acos(dot);
+        wa = sin((1 - t) * theta) / sin(theta);
+        wb = sin(t * theta) / sin(theta);
+    }
+    double norm = 0;
+    for (int i = 0; i < 4; i++) {
+        sample.q[i] = wa * a.q[i] + wb * q[i];
+        norm += sample.q[i] * sample.q[i];
+    }
+    norm = sqrt(norm);
+    for (int i = 0; i < 4; i++) sample.q[i] /= norm;
+    return sample;
+}
+
+TransformTreeNode::TransformTreeNode(const string& id, const int memory_duration_ms, const int capacity) :
+frame_id(id), samples(max(capacity, 1)), memory_duration(memory_duration_ms * 1000000LL) {
     parent = nullptr;
 }
 
-bool TransformTreeNode::transform(KDL::Frame& frame, const google::protobuf::Timestamp least_stamp, int tolerance_ms) {
-    if (value_time_series.empty()) return false;
+size_t TransformTreeNode::lower_bound(const int64_t& stamp) {
+    size_t first = 0, length = count;
+    while (length > 0) {
+        const size_t half = length / 2;
+        if (at(first + half).stamp < stamp) {
+            first += half + 1;
+            length -= half + 1;
+        } else {
+            length = half;
+        }
+    }
+    return first;
+}
+
+bool TransformTreeNode::transform(KDL::Frame& frame, const google::protobuf::Timestamp least_stamp, int tolerance_ms, int extrapolation_ms) {
+    if (count == 0) return false;
     if (is_static || tolerance_ms < 0) {
-        frame = value_time_series.rbegin()->toKDL();
+        frame = at(count - 1).toKDL();
         return true;
     }
-    std_msgs::TransformD time_token; 
-    time_token.mutable_header()->mutable_timestamp()->CopyFrom(least_stamp);
-    TransformEntry token {time_token};
-    auto find_least_ptr = value_time_series.lower_bound(token);
-    if (find_least_ptr == value_time_series.end()) find_least_ptr = prev(value_time_series.end());
-
-    auto found_transform = *find_least_ptr;
-
-    int64_t time_diff_ms = (found_transform.transform.header().timestamp().seconds() - least_stamp.seconds()) * 1000 
-                        + (found_transform.transform.header().timestamp().nanos() - least_stamp.nanos()) / 1000;
-    if (abs(time_diff_ms) <= tolerance_ms) {
-        frame = found_transform.toKDL();
+    const int64_t stamp = to_ns(least_stamp);
+    const size_t found = lower_bound(stamp);
+    if (found < count && at(found).stamp == stamp) {
+        frame = at(found).toKDL();
+        return true;
+    }
+    const int64_t tolerance_ns = tolerance_ms * 1000000LL;
+    if (found > 0 && found < count) {
+        const TransformSample& before = at(found - 1);
+        const TransformSample& after = at(found);
+        // a wider gap, e.g. after dropped messages, is not blended, only its nearer end may be taken
+        if (after.stamp - before.stamp <= 2 * tolerance_ns) {
+            frame = TransformSample::interpolate(before, after, stamp).toKDL();
+            return true;
+        }
+        const TransformSample& nearest = stamp - before.stamp <= after.stamp - stamp ? before : after;
+        if (abs(nearest.stamp - stamp) > tolerance_ns) return false;
+        frame = nearest.toKDL();
+        return true;
+    }
+    // out of the history, found is 0 or count
+    const size_t end = found == 0 ? 0 : count - 1;
+    const int64_t distance = abs(at(end).stamp - stamp);
+    if (count > 1 && distance <= extrapolation_ms * 1000000LL) {
+        const size_t other = found == 0 ? 1 : count - 2;
+        frame = TransformSample::interpolate(at(other), at(end), stamp).toKDL();
+        return true;
+    }
+    if (distance <= tolerance_ns) {
+        frame = at(end).toKDL();
         return true;
     }
     return false; 
 }
 
-void TransformTreeNode::cleanup(google::protobuf::Timestamp current_time) {
-    if (is_static) return;
-    auto time_diff_ms = [](const google::protobuf::Timestamp& l, const google::protobuf::Timestamp& r) {
-        return (r.seconds() - l.seconds()) * 1000 
-                + (r.nanos() - l.nanos()) / 1000;
-    };
-    auto it = value_time_series.begin();
-    while (it != value_time_series.end()) {
-        if (time_diff_ms(current_time, it->transform.header().timestamp()) > memory_duration ) {
-            it = value_time_series.erase(it);
-        } else {
-            ++it;
+void TransformTreeNode::push(const std_msgs::TransformD& transform) {
+    TransformSample sample;
+    sample.stamp = to_ns(transform.header().timestamp());
+    sample.p[0] = transform.transition().x();
+    sample.p[1] = transform.transition().y();
+    sample.p[2] = transform.transition().z();
+    sample.q[0] = transform.rotation().x();
+    sample.q[1] = transform.rotation().y();
+    sample.q[2] = transform.rotation().z();
+    sample.q[3] = transform.rotation().w();
+    if (count > 0 && sample.stamp <= at(count - 1).stamp) {
+        // late sample, older ones than the whole history are useless
+        if (sample.stamp < at(0).stamp) return;
+        size_t position = lower_bound(sample.stamp);
+        if (at(position).stamp == sample.stamp) {
+            at(position) = sample;
+            return;
         }
+        if (count == samples.size()) {
+            head = (head + 1) % samples.size();
+            count--;
+            position--;
+        }
+        for (size_t i = count; i > position; i--) at(i) = at(i - 1);
+        at(position) = sample;
+        count++;
+        return;
+    }
+    if (count == samples.size()) {
+        head = (head + 1) % samples.size();
+        count--;
+    }
+    at(count++) = sample;
+    if (is_static) return;
+    while (count > 1 && sample.stamp - at(0).stamp > memory_duration) {
+        head = (head + 1) % samples.size();
+        count--;
     }
-}
-
-void TransformTreeNode::push(const std_msgs::TransformD transform) {
-    value_time_series.insert({transform});
-    google::protobuf::Timestamp current_time = value_time_series.rbegin()->transform.header().timestamp();
-    cleanup(current_time);
 }
 
 void TransformTree::addTransformNode(const std_msgs::TransformD transform, bool is_static) {
@@ -137,7 +212,7 @@ bool TransformTree::get_transform(KDL::Frame& frame, const string from, const st
     TransformTreeNode* current_node = nodes[from];
     while (current_node && (current_node != root)) {
         KDL::Frame current_transform;
-        if (!current_node->transform(current_transform, least_stamp, tolerance_ms)) return false;
+        if (!current_node->transform(current_transform, least_stamp, tolerance_ms, max_extrapolation)) return false;
         frame = current_transform * frame;
         current_node = current_node->parent;
     }
@@ -145,7 +220,7 @@ bool TransformTree::get_transform(KDL::Frame& frame, const string from, const st
     current_node = nodes[to];
     while (current_node && (current_node != root)) {
         KDL::Frame current_transform;
-        if (!current_node->transform(current_transform, least_stamp, tolerance_ms)) return false;
+        if (!current_node->transform(current_transform, least_stamp, tolerance_ms, max_extrapolation)) return false;
         frame = current_transform * frame;
         current_node = current_node->parent;
     }
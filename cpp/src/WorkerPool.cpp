@@ -0,0 +1,45 @@
+#include "WorkerPool.hpp"
+namespace core {
+WorkerPool::WorkerPool(const int& workers, const size_t& max_queue) : max_queue(max_queue) {
+    for (int i = 0; i < workers; i++) threads.emplace_back(&WorkerPool::run, this);
+    LOG(INFO) << "Create worker pool with " << workers << " threads";
+}
+
+WorkerPool::~WorkerPool() {
+    {
+        unique_lock<mutex> lock(mtx);
+        stopping = true;
+    }
+    cv.notify_all();
+    for (auto &t: threads) t.join();
+}
+
+bool WorkerPool::post(function<void()> task) {
+    {
+        unique_lock<mutex> lock(mtx);
+        if (max_queue > 0 && tasks.size() >= max_queue) return false;
+        tasks.push_back(move(task));
+    }
+    cv.notify_one();
+    return true;
+}
+
+int WorkerPool::size() const {
+    return threads.size();
+}
+
+void WorkerPool::run() {
+    while (true) {
+        function<void()> task;
+        {
+            unique_lock<mutex> lock(mtx);
+            cv.wait(lock, [this]() { return stopping || !tasks.empty(); });
+            // queued tasks are finished before the workers leave
+            if (tasks.empty()) return;
+            task = move(tasks.front());
+            tasks.pop_front();
+        }
+        task();
+    }
+}
+}
@@ -1,6 +1,31 @@
 #include "rscl.hpp"
 #include "NodeRegist.hpp"
 namespace core {
+static string param_events_topic(const string& node) {
+    return "/" + node + "/param_events";
+}
+
+// CORE_* settings, an unset or malformed variable keeps the default
+static long env_int(const char* name, const long fallback) {
+    const char* value = getenv(name);
+    if (!value) return fallback;
+    char* end;
+    const long parsed = strtol(value, &end, 10);
+    if (end == value || *end != '\0') {
+        LOG(WARNING) << name << " is not a number: " << value;
+        return fallback;
+    }
+    return parsed;
+}
+static bool env_flag(const char* name, const bool fallback) {
+    const char* value = getenv(name);
+    if (!value) return fallback;
+    if (string(value) == "1") return true;
+    if (string(value) == "0") return false;
+    LOG(WARNING) << name << " is neither 0 nor 1: " << value;
+    return fallback;
+}
+
 NodeHandler::NodeHandler(const string& name_, const string& namespace_) :
 name(namespace_ + "/" + name_) {
     core_exception::catcher_init();
@@ -18,14 +43,22 @@ name(namespace_ + "/" + name_) {
     } else {
         this_node_connection_rpc_ip = "127.0.0.1";
     }
+    topic_multiplex = env_flag("CORE_TOPIC_MULTIPLEX", topic_multiplex);
+    zerocopy_threshold = env_int("CORE_ZEROCOPY_THRESHOLD", zerocopy_threshold);
+    service_worker_count = env_int("CORE_SERVICE_WORKERS", service_worker_count);
+    local_service = env_flag("CORE_LOCAL_SERVICE", local_service);
+    param_events = env_flag("CORE_PARAM_EVENTS", param_events);
+    // made here, parameters loaded or declared before Init are there when the node registers
+    param_server = make_shared<ParamRPCServerImpl>();
 }
 
 void NodeHandler::Init() {
-    tcp_topic_clients = make_shared<TCPClient>();
+    tcp_topic_clients = make_shared<TCPClient>(zerocopy_threshold);
     tcp_topic_server = make_shared<TCPServer>(this_node_connection_rpc_ip);
 
-    param_server = make_shared<ParamRPCServerImpl>();
     param_clients = make_shared<ParamRPCClientClub>();
+    // with no workers every service callback runs inline, with workers a flood of pipelined calls is refused as overloaded
+    if (service_worker_count > 0) service_workers = make_shared<WorkerPool>(service_worker_count, DEFAULT_SERVICE_QUEUE);
 
     this_node_tcp_port = tcp_topic_server->init_tcp_srv();
     connection_rpc_service = make_shared<NodeConnectionServerImpl>(shared_from_this());
@@ -38,6 +71,9 @@ void NodeHandler::Init() {
     this_node_connection_rpc_port = rpc_port_;
 
     connection_rpc_clients = make_shared<NodeConnectionClientClub>(shared_from_this());
+    // advertised whatever this node watches with, publish is a no op while nobody subscribes
+    param_events_pub = make_shared<Publisher<ParamEvent>>(advertise<ParamEvent>(param_events_topic(name)));
+    param_server->publishEvents([this](const ParamEvent& event) {param_events_pub->publish(event);});
     node_register = make_shared<NodeRegist>(name, shared_from_this());
 }
 
@@ -45,16 +81,111 @@ void NodeHandler::spinOnce() {
     int ret = tcp_topic_server->event_handler();
 }
 
+void NodeHandler::unwatchRemoteParameter(const string& name, const string& namespace_) {
+    param_clients->unwatchRemoteRequest(name, namespace_);
+    unique_lock<mutex> lock(param_events_mtx);
+    if (param_event_slots.count(namespace_)) param_event_slots[namespace_].erase(name);
+}
+
+ParameterStatus NodeHandler::watch_param_events(const string& name, const string& namespace_, function<void(const google::protobuf::Any&)> cb) {
+    bool subscribe_ = false;
+    {
+        unique_lock<mutex> lock(param_events_mtx);
+        param_event_slots[namespace_][name] = param_event_slot{cb, 0};
+        subscribe_ = param_event_nodes.insert(namespace_).second;
+    }
+    if (subscribe_) {
+        subscribe(param_events_topic(namespace_), function<void(const ParamEvent*)>([this, namespace_](const ParamEvent* event) {
+            on_param_event(namespace_, *event);
+        }));
+    }
+    // the topic only carries changes, a value not read now is read when the node or its topic connects
+    ParamBatchRequest request;
+    request.add_get(name);
+    return read_param_events(namespace_, request) ? ParameterStatus::NORMAL : ParameterStatus::TMEP_NOT_AVALIABLE;
+}
+
+bool NodeHandler::read_param_events(const string& namespace_, const ParamBatchRequest& request) {
+    ParamBatchReply reply = param_clients->batchRemoteRequest(request, namespace_);
+    bool complete = reply.got_size() == request.get_size();
+    for (auto &got: reply.got()) {
+        if (got.status() != ParameterStatus::NORMAL) {
+            complete = false;
+            continue;
+        }
+        ParamEvent event;
+        event.set_name(got.name());
+        event.set_version(got.version());
+        event.mutable_payload()->CopyFrom(got.payload());
+        on_param_event(namespace_, event);
+    }
+    return complete;
+}
+
+void NodeHandler::refresh_param_events(const string& namespace_) {
+    ParamBatchRequest request;
+    {
+        unique_lock<mutex> lock(param_events_mtx);
+        auto node = param_event_slots.find(namespace_);
+        if (node == param_event_slots.end()) return;
+        for (auto &slot: node->second) request.add_get(slot.first);
+    }
+    if (request.get_size() > 0) read_param_events(namespace_, request);
+}
+
+void NodeHandler::on_param_event(const string& namespace_, const ParamEvent& event) {
+    function<void(const google::protobuf::Any&)> cb;
+    {
+        unique_lock<mutex> lock(param_events_mtx);
+        auto node = param_event_slots.find(namespace_);
+        if (node == param_event_slots.end()) return;
+        auto slot = node->second.find(event.name());
+        if (slot == node->second.end() || event.version() <= slot->second.version) return;
+        slot->second.version = event.version();
+        cb = slot->second.cb;
+    }
+    cb(event.payload());
+}
+
+ParameterStatus NodeHandler::batchRemoteParameters(const ParamBatch& batch, ParamBatchResult& result, const string& namespace_) {
+    result = ParamBatchResult(param_clients->batchRemoteRequest(batch.request(), namespace_));
+    return result.status();
+}
+
+bool NodeHandler::saveParameters(const string& path) {
+    return param_server->save(path);
+}
+
+bool NodeHandler::loadParameters(const string& path) {
+    return param_server->load(path);
+}
+
 void NodeHandler::regist_node(const string& node, const string& ip, const int& port) {
     LOG(INFO) << "connect to connection server on node: " << node << "@" << ip << ":" << port;
     connection_rpc_clients->add_client(node, ip + ":" + to_string(port));
     param_clients->add_client(node, ip + ":" + to_string(port));
+    refresh_param_events(node);
 }
 
 void NodeHandler::delete_node(const string& node) {
     LOG(INFO) << "delete connection server between this and node: " << node;
     connection_rpc_clients->delete_client(node);
     param_clients->delete_client(node);
+    {
+        // a restarted node counts its versions again
+        unique_lock<mutex> lock(param_events_mtx);
+        if (param_event_slots.count(node)) {
+            for (auto &slot: param_event_slots[node]) slot.second.version = 0;
+        }
+    }
+    // clients drop the connections to its servers once the streams close
+    unique_lock<shared_mutex> lock(services_mtx);
+    for (auto &served: served_services) {
+        for (auto it = served.second.servers.begin(); it != served.second.servers.end();) {
+            if (it->second == node) it = served.second.servers.erase(it);
+            else it++;
+        }
+    }
 }
 
 const string NodeHandler::this_node_name() {return name;}
@@ -75,37 +206,46 @@ void NodeHandler::add_subscribed_topic(const string& topic, const string& url) {
     topics["s"+topic] = url;
 }
 
-client_info NodeHandler::add_tcp_client(const string& node, const string& topic, const string& ip, const int& port) {
+client_info NodeHandler::add_tcp_client(const string& node, const string& topic, const string& ip, const int& port, bool multiplex, bool high_priority) {
     /* 
     create a tcp client connect to input server,
     map client object to that topic in tcp clients.
+    if multiplexed, the topic becomes a channel of the session to that server.
+    high priority topics never share a connection with normal ones.
     */
-    client_info info = tcp_topic_clients->add_client(topic, ip, port);
+    client_info info = tcp_topic_clients->add_client(topic, ip, port, multiplex, high_priority);
     return info;
 }
 
-bool NodeHandler::find_wait_served_service(const string& service) {
-    shared_lock<shared_mutex> lock(services_mtx);
-    const string token = "d" + service;
-    return services.count(token);
-}
-future<string> NodeHandler::add_served_service(const string& service) {
-    unique_lock<shared_mutex> lock(services_mtx);
-    const string token = "d" + service;
-    if (services.count(token)) {
-        core::setAbort();
-        LOG(ERROR) << "dulicated service client";
-        exit(-1);
+uint64_t NodeHandler::add_served_service(const string& service, function<void(const string&)> on_server) {
+    /*
+    register a service client of this node, it is told at once about the servers known so far,
+    and later about each new one.
+    */
+    vector<string> servers;
+    uint64_t client_id;
+    {
+        unique_lock<shared_mutex> lock(services_mtx);
+        client_id = next_service_client++;
+        served_services[service].clients[client_id] = on_server;
+        for (auto &server: served_services[service].servers) servers.push_back(server.first);
     }
-    services[token] = promise<string>();
-    return services["d" + service].get_future();
+    for (auto &srv_addr: servers) on_server(srv_addr);
+    return client_id;
 }
 
-future<string> NodeHandler::reset_served_service(const string& service) {
+void NodeHandler::remove_served_service(const string& service, const uint64_t& client_id) {
     unique_lock<shared_mutex> lock(services_mtx);
-    const string token = "d" + service;
-    services[token] = promise<string>();
-    return services["d" + service].get_future();
+    served_services[service].clients.erase(client_id);
+}
+
+vector<string> NodeHandler::served_service_servers(const string& service) {
+    shared_lock<shared_mutex> lock(services_mtx);
+    vector<string> servers;
+    auto it = served_services.find(service);
+    if (it == served_services.end()) return servers;
+    for (auto &server: it->second.servers) servers.push_back(server.first);
+    return servers;
 }
 
 void NodeHandler::add_serving_service(const string& service) {
@@ -119,26 +259,36 @@ bool NodeHandler::find_serving_service(const string& service) {
 }
 bool NodeHandler::add_rpc_service_client(const string& node, const string& service, const string& ip, const int& port) {
     /* 
-    create a rpc client connect to input server,
-    map client object to that service in rpc clients.
+    remember the server of that service,
+    and let every service client of it on this node connect.
     */
-    unique_lock<shared_mutex> lock(services_mtx);
-    try {
-        services["d" + service].set_value(ip + ":" + to_string(port));
-        return true;
-    } catch (const std::future_error& e) {
-        return false;
-    } catch (const std::exception& e) {
-        services["d" + service].set_exception(current_exception());
-        return false;
+    const string srv_addr = ip + ":" + to_string(port);
+    {
+        unique_lock<shared_mutex> lock(services_mtx);
+        served_service& served = served_services[service];
+        if (served.servers.count(srv_addr)) return true;
+        served.servers[srv_addr] = node;
     }
+    // called under the lock, a client being destroyed waits in remove_served_service until they return
+    shared_lock<shared_mutex> lock(services_mtx);
+    auto it = served_services.find(service);
+    if (it == served_services.end()) return true;
+    for (auto &client: it->second.clients) client.second(srv_addr);
+    return true;
 }
 
-bool NodeHandler::accept_topic_publish(const string& topic, const string& ip, const int& port) {
+bool NodeHandler::accept_topic_publish(const string& topic, const string& ip, const int& port, const int& channel, bool high_priority) {
     /* 
     set topic slot state used by client@ip:port
     */
-    tcp_topic_server->accept_client(topic, ip, port);
+    tcp_topic_server->accept_client(topic, ip, port, channel > 0, high_priority);
+    // changes published before the event topic of a watched node connected are read instead
+    string watched_node;
+    {
+        unique_lock<mutex> lock(param_events_mtx);
+        for (auto &node: param_event_nodes) if (param_events_topic(node) == topic) watched_node = node;
+    }
+    if (!watched_node.empty()) refresh_param_events(watched_node);
     return true;
 }
 bool NodeHandler::accept_service_client(const string& service) {
@@ -159,7 +309,8 @@ const ConnectionRequest*request, ConnectionReply* reply) {
     const string type_url = request->url();
     while (core::ok() && !context->IsCancelled()) {
         if (nh_->find_wait_published_topic(topic, type_url)) {
-            auto client_info = nh_->add_tcp_client(node, topic, ip, port);
+            auto client_info = nh_->add_tcp_client(node, topic, ip, port, request->multiplex(), 
+                request->priority() == HIGH_PRIORITY);
             bool connected = client_info.connected.get();
             if (! connected) {
                 LOG(ERROR) << "failed to establish connection on topic: " << topic;
@@ -169,6 +320,8 @@ const ConnectionRequest*request, ConnectionReply* reply) {
             reply->set_ip(client_info.ip);
             reply->set_port(client_info.port);
             reply->set_url(type_url);
+            reply->set_channel(client_info.channel);
+            reply->set_priority(client_info.high_priority? HIGH_PRIORITY: NORMAL_PRIORITY);
             break;
         }
         unique_lock<mutex> lock(mtx);
@@ -186,27 +339,10 @@ const ConnectionRequest*request, ConnectionReply* reply) {
     const string service = request->object();
     const string ip = request->ip();
     const int port = request->port();
-    if (nh_->find_serving_service(service)) {
-        core::setAbort();
-        LOG(ERROR) << "service name conflict with other service server, exit...";
-        exit(-1);
-    }
-    while (core::ok() && !context->IsCancelled()) {
-        if (nh_->find_wait_served_service(service)) {
-            if (!nh_->add_rpc_service_client(node, service, ip, port)) {
-                LOG(ERROR) << "temporary failed to establish connection on service: " << service;
-                this_thread::sleep_for(chrono::seconds(1));
-                continue;
-            }
-            reply->set_object(service);
-            break;
-        }
-        unique_lock<mutex> lock(mtx);
-        cv.wait(lock, [&]() {
-            return nh_->find_wait_served_service(service) || !core::ok();
-        });
-    }
-    LOG(INFO) << "create connection on service: " << service;
+    // many servers may share a service name, clients balance their requests over all of them
+    nh_->add_rpc_service_client(node, service, ip, port);
+    reply->set_object(service);
+    LOG(INFO) << "add server of service: " << service << "@" << ip << ":" << port;
     return Status::OK;
 }
 
@@ -238,7 +374,8 @@ void NodeConnectionClient::pull_subscribe_request(const ConnectionRequest& reque
         ConnectionReply reply;
         Status status = stub_->TopicConnection(&context, request, &reply);
         if (status.ok()) {
-            if (this->nh_->accept_topic_publish(reply.object(), reply.ip(), reply.port()))
+            if (this->nh_->accept_topic_publish(reply.object(), reply.ip(), reply.port(), reply.channel(), 
+                reply.priority() == HIGH_PRIORITY))
                 LOG(INFO) << "accept topic pubilsher on topic: " << reply.object() << "@" << reply.ip() << ":" << reply.port();
         } else {
             LOG(ERROR) << "failed to accept publisher on topic: " << reply.object() << "@" << reply.ip() << ":" << reply.port();
@@ -280,12 +417,14 @@ void NodeConnectionClientClub::delete_client(const string& node) {
     clients.erase(node);
 }
 
-void NodeConnectionClientClub::pull_subscribe_request(const string& topic, const string& ip, const int& port, const string& type_url) {
+void NodeConnectionClientClub::pull_subscribe_request(const string& topic, const string& ip, const int& port, const string& type_url, bool multiplex, TopicPriority priority) {
     ConnectionRequest request;
     request.set_object(topic);
     request.set_ip(ip);
     request.set_port(port);
     request.set_url(type_url);
+    request.set_multiplex(multiplex);
+    request.set_priority(priority);
     request.set_node(nh_->this_node_name());
     unique_lock<shared_mutex> lock(mtx);
     topic_requests.push_back(request);
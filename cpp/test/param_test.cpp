@@ -32,11 +32,15 @@ int main(int argc, char* argv[]) {
 
     // Create and initialize the NodeHandler
     std::shared_ptr<core::NodeHandler> nh = std::make_shared<core::NodeHandler>(argv[1], argv[2]);
+    // Restore the values of the last run, before Init so remote nodes find them at once
+    const std::string snapshot = std::string(argv[1]) + "_params.snapshot";
+    nh->loadParameters(snapshot);
     nh->Init();
 
     // Declare parameters
     nh->declareParameter("string_param_const", string_param, true); // Constant parameter
-    nh->declareParameter("string_param", string_param, false); // Dynamic parameter
+    // The handle reads without locks, for loops that read the parameter at a high rate
+    core::ParamHandle<std_msgs::String> string_param_handle = nh->declareParameter("string_param", string_param, false); // Dynamic parameter
 
     // Set initial values for parameters
     nh->setParameter("string_param_const", string_param); // This won't change
@@ -59,7 +63,7 @@ int main(int argc, char* argv[]) {
     core::Rate rate(1);
     std::string user_input;
     while (core::ok()) {
-        LOG(INFO) << "Current parameter value: " << string_param.data();
+        LOG(INFO) << "Current parameter value: " << string_param_handle.get().data();
 
         // Prompt user for new parameter value
         LOG(INFO) << BLUE << "Enter a new value for 'string_param' (or type 'exit' to quit): " << RESET;
@@ -67,6 +71,7 @@ int main(int argc, char* argv[]) {
 
         if (user_input == "exit") {
             LOG(INFO) << "Exiting the program.";
+            nh->saveParameters(snapshot);
             break; // Exit the loop if the user types 'exit'
         }
 
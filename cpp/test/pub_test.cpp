@@ -17,6 +17,14 @@ int main(int argc, char* argv[]) {
     // Set up a publisher for the "hello" topic
     core::Publisher<std_msgs::String> pub = nh->advertise<std_msgs::String>("hello");
 
+    // Get notified when subscribers attach to or detach from the topic
+    pub.onSubscribe([](const int num_subscribers) {
+        LOG(INFO) << "Subscriber attached, now " << num_subscribers << " subscriber(s) on topic 'hello'.";
+    });
+    pub.onUnsubscribe([](const int num_subscribers) {
+        LOG(INFO) << "Subscriber detached, now " << num_subscribers << " subscriber(s) on topic 'hello'.";
+    });
+
     // Set the loop rate to 1 kHz (1000 Hz)
     core::Rate rate(1000);
 
@@ -27,6 +35,12 @@ int main(int argc, char* argv[]) {
     while (core::ok()) {
         nh->spinOnce(); // Optional if there are no subscribers
 
+        // Skip building the message when nobody is listening
+        if (!pub.hasSubscribers()) {
+            rate.sleep();
+            continue;
+        }
+
         // Create a message with the current count
         std_msgs::String string_msg;
         string_msg.set_data(std::to_string(count++));
@@ -38,10 +38,9 @@ int main(int argc, char* argv[]) {
     std_msgs::String param;
     core::ParameterStatus status = core::ParameterStatus::TMEP_NOT_AVALIABLE;
     
-    // Attempt to retrieve the remote parameter until it's available
+    // Wait for the remote parameter until it's available, later reads come from the local copy
     while ((status != core::ParameterStatus::NORMAL) && core::ok()) {
-        status = nh->getRemoteParameter("string_param", param, param_owner_name);
-        std::this_thread::sleep_for(std::chrono::seconds(1));
+        status = nh->getRemoteParameter("string_param", param, param_owner_name, std::chrono::seconds(1));
     }
 
     // Log the retrieved parameter value
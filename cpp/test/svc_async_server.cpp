@@ -0,0 +1,43 @@
+#include "core.hpp"
+#include "std.pb.h"
+#include <iostream>
+
+core::ServiceClient<std_msgs::String, std_msgs::String>* hello_client;
+
+// Coroutine service callback: forwards the request to the "hello" service without blocking a thread while it waits.
+// The token is canceled when our client cancels, and passing it on cancels the forwarded request as well.
+core::ServiceTask forward_cb(const std_msgs::String* request, std_msgs::String* reply,
+                core::ServiceServer<std_msgs::String, std_msgs::String>* service_server, const int call_id, core::CancellationToken token) {
+    LOG(INFO) << "Received request: " << request->data();
+    try {
+        std_msgs::String forwarded = co_await hello_client->request(*request, token);
+        reply->set_data("forwarded: " + forwarded.data());
+        if (token.cancelled()) service_server->setAborted(call_id);
+        else service_server->setSuccess(call_id);
+    } catch (const core::StreamCloseException& e) {
+        LOG(INFO) << "The hello service is not reachable: " << e.what();
+        service_server->setFailed(call_id);
+    }
+}
+
+int main(int argc, char* argv[]) {
+    if (argc < 3) {
+        LOG(WARNING) << "Require at least 2 arguments: name, namespace, "
+                     << "\nand remember {$namespace$name} should be unique for each node";
+        return 1;
+    }
+
+    std::shared_ptr<core::NodeHandler> nh = std::make_shared<core::NodeHandler>(argv[1], argv[2]);
+    nh->Init();
+
+    core::ServiceClient<std_msgs::String, std_msgs::String> service_client = nh->serviceClient<std_msgs::String, std_msgs::String>("hello");
+    hello_client = &service_client;
+    // Serve "hello_async" with a coroutine callback
+    core::ServiceServer<std_msgs::String, std_msgs::String> service_server = nh->serviceServer<std_msgs::String, std_msgs::String>("hello_async", forward_cb);
+
+    while (core::ok()) {
+        std::this_thread::sleep_for(std::chrono::seconds(1));
+    }
+
+    return 0;
+}
@@ -0,0 +1,74 @@
+#include "core.hpp"
+#include "std.pb.h"
+#include <algorithm>
+#include <chrono>
+#include <vector>
+
+// Round trip latency of a service, run the server and the client on one host,
+// then run the client again with CORE_LOCAL_SERVICE=0 to compare with grpc.
+void echo_cb(const std_msgs::String* request, std_msgs::String* reply,
+                core::ServiceServer<std_msgs::String, std_msgs::String>* service_server, const int& call_id) {
+    reply->set_data(request->data());
+    service_server->setSuccess(call_id);
+}
+
+int main(int argc, char* argv[]) {
+    if (argc < 4) {
+        LOG(WARNING) << "Require at least 3 arguments: name, namespace, server or client, [number of requests]"
+                     << "\nand remember {$namespace$name} should be unique for each node";
+        return 1;
+    }
+
+    std::shared_ptr<core::NodeHandler> nh = std::make_shared<core::NodeHandler>(argv[1], argv[2]);
+    nh->Init();
+    if (std::string(argv[3]) == "server") {
+        // inline, the callback is trivial and a worker hand off would dominate the measurement
+        core::ServiceServer<std_msgs::String, std_msgs::String> service_server = nh->serviceServer<std_msgs::String, std_msgs::String>("bench", echo_cb, true);
+        while (core::ok()) {
+            std::this_thread::sleep_for(std::chrono::seconds(1));
+        }
+        return 0;
+    }
+
+    const int count = argc > 4 ? std::stoi(argv[4]) : 10000;
+    core::ServiceClient<std_msgs::String, std_msgs::String> service_client = nh->serviceClient<std_msgs::String, std_msgs::String>("bench");
+    std_msgs::String request;
+    request.set_data(std::string(64, 'x'));
+    std::future<std_msgs::String> reply;
+    while (core::ok() && !service_client.request(request, reply)) {
+        std::this_thread::sleep_for(std::chrono::milliseconds(100));
+    }
+    reply.get();
+
+    std::vector<double> latency;
+    latency.reserve(count);
+    for (int i = 0; i < count && core::ok(); i++) {
+        auto start = std::chrono::steady_clock::now();
+        if (!service_client.request(request, reply)) break;
+        reply.get();
+        latency.push_back(std::chrono::duration<double, std::micro>(std::chrono::steady_clock::now() - start).count());
+    }
+    if (latency.empty()) return 1;
+    std::sort(latency.begin(), latency.end());
+    LOG(INFO) << latency.size() << " requests, p50 " << latency[latency.size() / 2] << " us, p99 "
+              << latency[latency.size() * 99 / 100] << " us, max " << latency.back() << " us";
+    // the same round trips split by the histograms of the client, percentiles are bucket bounds
+    core::ServiceLatency split = service_client.latency();
+    LOG(INFO) << "p99 queue " << split.queue.percentile(99).count() << " us, execute " << split.execute.percentile(99).count()
+              << " us, transport " << split.transport.percentile(99).count() << " us";
+
+    // the same requests again, 50 in each write
+    std::vector<std_msgs::String> batch(50, request);
+    std::vector<std::future<std_msgs::String>> replies;
+    auto start = std::chrono::steady_clock::now();
+    int sent = 0;
+    for (; sent < count && core::ok(); sent += batch.size()) {
+        if (!service_client.requestBatch(batch, replies)) break;
+        for (auto &batch_reply: replies) batch_reply.get();
+    }
+    if (sent > 0) {
+        LOG(INFO) << sent << " batched requests, " << std::chrono::duration<double, std::micro>(std::chrono::steady_clock::now() - start).count() / sent
+                  << " us each";
+    }
+    return 0;
+}
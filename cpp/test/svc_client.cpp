@@ -14,6 +14,9 @@ int main(int argc, char* argv[]) {
     std::shared_ptr<core::NodeHandler> nh = std::make_shared<core::NodeHandler>(argv[1], argv[2]);
     nh->Init();
     core::ServiceClient<std_msgs::String, std_msgs::String> service_client = nh->serviceClient<std_msgs::String, std_msgs::String>("hello");
+    service_client.onFeedback<std_msgs::Int32>([](const uint64_t& request_id, const std_msgs::Int32& progress) {
+        LOG(INFO) << "Progress of request " << request_id << ": " << progress.data();
+    });
 
     std_msgs::String request;
     request.set_data("test request");
@@ -34,6 +34,10 @@ void service_cb(const std_msgs::String* request, std_msgs::String* reply,
         // Simulate processing time
         std::this_thread::sleep_for(std::chrono::seconds(1));
         if (count++ > 10) break; // Simple break condition to avoid infinite loop
+        // Report the progress to the client, no polling needed on its side
+        std_msgs::Int32 progress;
+        progress.set_data(count);
+        service_server->publishFeedback(stream_id, progress);
     }
 
     // Set the service status to success if it was not aborted